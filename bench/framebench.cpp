@@ -0,0 +1,73 @@
+// Throughput benchmark of RelayFrameParser
+//
+// A stream of LCUS frames, clean or with garbage bytes and corrupted checksums mixed in, is fed
+// to the parser in chunks of various sizes. Every chunking must find the same frames as the
+// whole stream fed at once. Usage: framebench [megabytes]
+
+#include <relayframe.hpp>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+// Builds a stream of frames, with noise if garbage is not 0 (one event in garbage frames)
+static std::vector<char> makeStream(size_t bytes, int garbage, size_t &validframes) {
+    std::mt19937 random(42);
+    std::vector<char> stream;
+    stream.reserve(bytes + 16);
+    validframes = 0;
+    while (stream.size() < bytes) {
+        unsigned char channel = 1 + random() % 64, state = random() & 1;
+        unsigned char frame[4] = {RELAYFRAME_HEADER, channel, state, (unsigned char)(RELAYFRAME_HEADER + channel + state)};
+        int event = garbage ? random() % garbage : -1;
+        if (event == 0) { // Garbage bytes, headers included
+            for (int i = random() % 8; i >= 0; i--)
+                stream.push_back(random() % 3 ? (char)(random() & 0xff) : (char)RELAYFRAME_HEADER);
+        }
+        else if (event == 1) { // Corrupted checksum
+            frame[3] ^= 0x5a;
+        }
+        stream.insert(stream.end(), frame, frame + 4);
+        if (event != 1)
+            validframes++;
+    }
+    return stream;
+}
+
+int main(int argc, char **argv) {
+    size_t bytes = (argc > 1 ? std::stoul(argv[1]) : 64) << 20;
+    std::cout << std::left << std::setw(8) << "stream" << std::setw(8) << "chunk" << std::setw(14) << "MB/s"
+              << std::setw(14) << "Mframes/s" << std::setw(12) << "frames" << std::setw(12) << "bad"
+              << "skipped" << std::endl;
+    bool ok = true;
+    for (int garbage : {0, 16}) {
+        size_t expected;
+        std::vector<char> stream = makeStream(bytes, garbage, expected);
+        RelayFrameParser reference(64);
+        uint64_t referencesum = 0;
+        reference.feed(stream.data(), stream.size(), [&](const RelayFrame &frame) { referencesum += frame.channel * 2 + frame.state; });
+        for (size_t chunk : {1ul, 7ul, 64ul, 4096ul, 1ul << 20}) {
+            RelayFrameParser parser(64);
+            uint64_t sum = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t offset = 0; offset < stream.size(); offset += chunk)
+                parser.feed(stream.data() + offset, std::min(chunk, stream.size() - offset),
+                            [&](const RelayFrame &frame) { sum += frame.channel * 2 + frame.state; });
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            const RelayFrameStats &stats = parser.getStats();
+            if (sum != referencesum || stats.frames != reference.getStats().frames || (garbage == 0 && stats.frames != expected))
+                ok = false;
+            std::cout << std::setw(8) << (garbage ? "noisy" : "clean") << std::setw(8) << chunk
+                      << std::setw(14) << std::fixed << std::setprecision(0) << stream.size() / elapsed / 1e6
+                      << std::setw(14) << std::setprecision(1) << stats.frames / elapsed / 1e6
+                      << std::setw(12) << stats.frames << std::setw(12) << stats.checksumerrors
+                      << stats.discardedbytes << std::endl;
+        }
+    }
+    if (!ok)
+        std::cout << "chunked parsing differs from the reference" << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+// Switching jitter benchmark on a simulated board (Linux only)
+//
+// A relay of a pseudo terminal board is toggled on a fixed schedule, and the time of each
+// write is compared with its scheduled time. The schedule is followed with relative sleeps
+// (os_sleep, the previous behaviour), then with absolute deadlines (sleepUntil) without and
+// with a final spin. Relative sleeps accumulate the lateness of every wake-up into a drift.
+// Usage: jitterbench [switches per mode] [period in us]
+
+#include <usbmrelay.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pty.h>
+#include <unistd.h>
+
+struct Mode {
+    const char *name;
+    bool absolute;
+    unsigned int spinus;
+};
+
+// Discard everything written to the board
+static void simulateBoard(int master) {
+    char buffer[4096];
+    while (read(master, buffer, sizeof(buffer)) > 0) {
+    }
+}
+
+int main(int argc, char **argv) {
+    int switches = argc > 1 ? std::stoi(argv[1]) : 1000;
+    long periodus = argc > 2 ? std::stol(argv[2]) : 2000;
+    if (switches < 1 || periodus < 1000) {
+        std::cerr << "usage: jitterbench [switches >= 1] [period in us >= 1000]" << std::endl;
+        return 2;
+    }
+    int master, slave;
+    char name[64];
+    if (openpty(&master, &slave, name, NULL, NULL) != 0)
+        return 1;
+    Usbmrelay board(name, 8);
+    if (board.openCom() != 1)
+        return 1;
+    close(slave);
+    board.setDelay(0);
+    board.initBoard();
+    std::thread drain(simulateBoard, master);
+
+    const Mode modes[] = {{"os_sleep", false, 0}, {"deadline", true, 0}, {"spin 50us", true, 50}, {"spin 200us", true, 200}};
+    std::cout << std::left << std::setw(12) << "schedule" << std::setw(12) << "mean us" << std::setw(12) << "p50 us"
+              << std::setw(12) << "p99 us" << std::setw(12) << "p99.9 us" << std::setw(12) << "max us"
+              << "drift us" << std::endl;
+    for (const Mode &mode : modes) {
+        std::vector<double> deviations;
+        deviations.reserve(switches);
+        TimePoint start = SteadyClock::now();
+        for (int i = 1; i <= switches; i++) {
+            TimePoint scheduled = start + std::chrono::microseconds(periodus * i);
+            if (mode.absolute)
+                sleepUntil(scheduled, mode.spinus);
+            else
+                os_sleep(periodus / 1000); // What a loop of relative sleeps does
+            board.setStateMask(i & 1);
+            deviations.push_back(std::chrono::duration<double, std::micro>(SteadyClock::now() - scheduled).count());
+        }
+        double drift = deviations.back();
+        std::sort(deviations.begin(), deviations.end());
+        double sum = 0;
+        for (double d : deviations)
+            sum += d;
+        auto at = [&](double q) { return deviations[(size_t)((deviations.size() - 1) * q)]; };
+        std::cout << std::setw(12) << mode.name << std::fixed << std::setprecision(1)
+                  << std::setw(12) << sum / deviations.size() << std::setw(12) << at(0.5)
+                  << std::setw(12) << at(0.99) << std::setw(12) << at(0.999) << std::setw(12) << deviations.back()
+                  << drift << std::endl;
+    }
+    board.closeCom();
+    close(master);
+    drain.join();
+    return 0;
+}
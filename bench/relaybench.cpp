@@ -0,0 +1,150 @@
+// Contention benchmark of the Usbmrelay submission paths on a simulated board (Linux only)
+//
+// The board is a pseudo terminal drained by a thread. 1 to 32 producer threads switch random
+// relays of a 64 relays board, either by calling setStateMask directly, serialized by the frame
+// lock, or by submitting the commands to the writer thread through the lock-free queue, which
+// merges the commands waiting in the queue. A reader thread takes state snapshots meanwhile.
+// Usage: relaybench [commands per configuration]
+
+#include <usbmrelay.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pty.h>
+#include <unistd.h>
+
+enum Mode { DIRECT, SUBMIT };
+
+struct Result {
+    double commandsPerSecond;
+    double meanNs;
+    double p99Ns;
+    double framesPerCommand;
+    unsigned long snapshots;
+};
+
+// Discard everything written to the board, count the frames
+static void simulateBoard(int master, std::atomic<unsigned long> &bytes) {
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(master, buffer, sizeof(buffer))) > 0)
+        bytes.fetch_add(n, std::memory_order_relaxed);
+}
+
+static bool run(int producers, Mode mode, int commands, Result &result) {
+    int master, slave;
+    char name[64];
+    if (openpty(&master, &slave, name, NULL, NULL) != 0)
+        return false;
+    std::atomic<unsigned long> bytes{0};
+    bool ok;
+    {
+        Usbmrelay board(name, 64);
+        if (board.openCom() != 1)
+            return false;
+        close(slave);
+        board.setDelay(0);
+        board.initBoard();
+        board.setStateMask(0xff00); // Relays 1 to 8 off, their pairs on
+        std::thread drain(simulateBoard, master, std::ref(bytes));
+        if (mode == SUBMIT)
+            board.startWriter();
+
+        // Relays 9 to 16 are always switched to the complement of relays 1 to 8, in the same
+        // command: a snapshot taken in the middle of a command breaks the pairs
+        std::atomic<bool> done{false};
+        std::atomic<bool> torn{false};
+        unsigned long snapshots = 0;
+        std::thread reader([&] {
+            while (!done.load(std::memory_order_relaxed)) {
+                uint64_t state = board.getStateMask();
+                if (state >> 16 != 0 || ((state >> 8) & 0xff) != (~state & 0xff))
+                    torn.store(true);
+                snapshots++;
+            }
+        });
+
+        int perproducer = commands / producers > 0 ? commands / producers : 1;
+        std::vector<std::vector<double>> latencies(producers);
+        std::atomic<int> failures{0};
+        unsigned long before = bytes.load();
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; p++) {
+            threads.emplace_back([&, p] {
+                std::mt19937 random(p);
+                latencies[p].reserve(perproducer);
+                for (int i = 0; i < perproducer; i++) {
+                    uint64_t low = random() & 0xff;
+                    uint64_t state = low | ((~low & 0xff) << 8);
+                    auto t0 = std::chrono::steady_clock::now();
+                    int status;
+                    if (mode == DIRECT)
+                        status = board.setStateMask(state);
+                    else
+                        while ((status = board.submitState(state)) != 1) // Queue full: let the writer catch up
+                            std::this_thread::yield();
+                    auto t1 = std::chrono::steady_clock::now();
+                    if (status != 1)
+                        failures++;
+                    latencies[p].push_back(std::chrono::duration<double, std::nano>(t1 - t0).count());
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        board.stopWriter();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        done.store(true);
+        reader.join();
+        board.closeCom();
+        drain.join();
+
+        std::vector<double> all;
+        for (auto &l : latencies)
+            all.insert(all.end(), l.begin(), l.end());
+        std::sort(all.begin(), all.end());
+        double sum = 0;
+        for (double l : all)
+            sum += l;
+        result.commandsPerSecond = all.size() / elapsed;
+        result.meanNs = sum / all.size();
+        result.p99Ns = all[(all.size() - 1) * 99 / 100];
+        result.framesPerCommand = (bytes.load() - before) / 4.0 / all.size();
+        result.snapshots = snapshots;
+        ok = failures == 0 && !torn && board.getWriterErrors() == 0;
+    }
+    close(master);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int commands = argc > 1 ? std::stoi(argv[1]) : 200000;
+
+    const char *names[] = {"direct", "submit"};
+    std::cout << std::left << std::setw(11) << "producers" << std::setw(9) << "path"
+              << std::setw(16) << "commands/s" << std::setw(16) << "mean call ns"
+              << std::setw(16) << "p99 call ns" << std::setw(16) << "frames/command"
+              << "snapshots" << std::endl;
+    for (int producers : {1, 2, 4, 8, 16, 32}) {
+        for (Mode mode : {DIRECT, SUBMIT}) {
+            Result result;
+            if (!run(producers, mode, commands, result)) {
+                std::cout << std::setw(11) << producers << std::setw(9) << names[mode] << "failed" << std::endl;
+                continue;
+            }
+            std::cout << std::setw(11) << producers << std::setw(9) << names[mode]
+                      << std::setw(16) << std::fixed << std::setprecision(0) << result.commandsPerSecond
+                      << std::setw(16) << result.meanNs << std::setw(16) << result.p99Ns
+                      << std::setw(16) << std::setprecision(3) << result.framesPerCommand
+                      << result.snapshots << std::endl;
+        }
+    }
+    return 0;
+}
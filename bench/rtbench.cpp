@@ -0,0 +1,122 @@
+// Switching latency under CPU stress, with and without the real-time mode (Linux only)
+//
+// A thread toggles a relay of a pseudo terminal board on a 1 ms schedule while stress threads
+// keep every CPU busy and churn memory. The latency of a switch is the time from its deadline
+// to the end of its write. The run is made with the normal scheduler, then with the driving
+// thread in real-time mode (enterRealtime: SCHED_FIFO, pinned, memory locked and prefaulted).
+// Usage: rtbench [switches per run] [stress threads per CPU] [cpu]
+
+#include <usbmrelay.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pty.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Discard everything written to the board
+static void simulateBoard(int master) {
+    char buffer[4096];
+    while (read(master, buffer, sizeof(buffer)) > 0) {
+    }
+}
+
+// Burns CPU and allocates, touches and frees memory of varied sizes
+static void stress(std::atomic<bool> &stop, unsigned int seed) {
+    while (!stop.load(std::memory_order_relaxed)) {
+        seed = seed * 1103515245 + 12345;
+        size_t size = 4096 + (seed >> 8) % (4 << 20);
+        char *block = (char *)malloc(size);
+        if (block != nullptr) {
+            for (size_t i = 0; i < size; i += 4096)
+                block[i] = (char)i;
+            free(block);
+        }
+    }
+}
+
+// Toggles the relay on schedule
+// Returns: the latency of each switch, in microseconds, sorted
+static std::vector<double> drive(Usbmrelay &board, int switches) {
+    std::vector<double> latencies(switches); // Allocated and prefaulted before the first deadline
+    prefault(latencies.data(), latencies.size() * sizeof(double));
+    PeriodicDeadline deadline(std::chrono::milliseconds(1));
+    for (int i = 0; i < switches; i++) {
+        TimePoint scheduled = deadline.next();
+        deadline.wait();
+        board.setStateMask(i & 1);
+        latencies[i] = std::chrono::duration<double, std::micro>(SteadyClock::now() - scheduled).count();
+    }
+    std::sort(latencies.begin(), latencies.end());
+    return latencies;
+}
+
+int main(int argc, char **argv) {
+    int switches = argc > 1 ? std::stoi(argv[1]) : 5000;
+    int perCpu = argc > 2 ? std::stoi(argv[2]) : 2;
+    int cpu = argc > 3 ? std::stoi(argv[3]) : 0;
+    if (switches < 1 || perCpu < 0) {
+        std::cerr << "usage: rtbench [switches >= 1] [stress threads per CPU] [cpu]" << std::endl;
+        return 2;
+    }
+    int master, slave;
+    char name[64];
+    if (openpty(&master, &slave, name, NULL, NULL) != 0)
+        return 1;
+    Usbmrelay board(name, 8);
+    if (board.openCom() != 1)
+        return 1;
+    close(slave);
+    board.setDelay(0);
+    board.initBoard();
+    std::thread drain(simulateBoard, master);
+
+    unsigned int cpus = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << cpus << " CPUs, " << cpus * perCpu << " stress threads, " << switches << " switches every 1 ms" << std::endl;
+    std::cout << std::left << std::setw(10) << "mode" << std::setw(12) << "p50 us" << std::setw(12) << "p99 us"
+              << std::setw(12) << "p99.9 us" << std::setw(12) << "max us" << "applied" << std::endl;
+    for (bool realtime : {false, true}) {
+        std::atomic<bool> stop{false};
+        std::vector<double> latencies;
+        std::string applied = "-";
+        std::thread driver([&] {
+            if (realtime) {
+                RealtimeConfig config;
+                config.priority = 80;
+                config.cpu = cpu;
+                RealtimeStatus status;
+                enterRealtime(config, &status);
+                applied = std::string(status.scheduler ? "fifo " : "") + (status.affinity ? "pinned " : "")
+                          + (status.memory ? "locked" : "");
+                if (applied.empty())
+                    applied = "none (permission denied?)";
+            }
+            latencies = drive(board, switches);
+            if (realtime)
+                leaveRealtime();
+        });
+        std::vector<std::thread> stressors;
+        for (unsigned int i = 0; i < cpus * perCpu; i++)
+            stressors.emplace_back(stress, std::ref(stop), i + 1);
+        driver.join();
+        stop.store(true);
+        for (auto &thread : stressors)
+            thread.join();
+        munlockall();
+        auto at = [&](double q) { return latencies[(size_t)((latencies.size() - 1) * q)]; };
+        std::cout << std::setw(10) << (realtime ? "realtime" : "normal") << std::fixed << std::setprecision(1)
+                  << std::setw(12) << at(0.5) << std::setw(12) << at(0.99) << std::setw(12) << at(0.999)
+                  << std::setw(12) << latencies.back() << applied << std::endl;
+    }
+    board.closeCom();
+    close(master);
+    drain.join();
+    return 0;
+}
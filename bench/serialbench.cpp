@@ -0,0 +1,207 @@
+// Benchmark of the serialib I/O engines on simulated ports (Linux only)
+//
+// Every port is a pseudo terminal. A child process plays the boards: it echoes each 4 bytes
+// relay frame it receives. The parent sends frames on 1, 16 and 64 ports and waits for the
+// echo, with the classic read/write/poll path, with serialib attached to an io_uring engine,
+// and with requests for all the ports batched in the engine.
+//
+// The system calls of the parent are counted by interposing the libc wrappers used by serialib.
+// Usage: serialbench [frames per configuration]
+
+#include <serialib.hpp>
+#include <serialuring.hpp>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdarg>
+#include <pty.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static bool counting = false;
+static unsigned long syscallCount = 0;
+
+// Forward to the next definition of a libc function and count the call
+#define FORWARD(ret, name, params, args)                                    \
+    extern "C" ret name params {                                            \
+        static ret (*real) params = (ret (*) params)dlsym(RTLD_NEXT, #name); \
+        if (counting) syscallCount++;                                       \
+        return real args;                                                   \
+    }
+
+FORWARD(ssize_t, read, (int fd, void *buf, size_t count), (fd, buf, count))
+FORWARD(ssize_t, write, (int fd, const void *buf, size_t count), (fd, buf, count))
+FORWARD(ssize_t, writev, (int fd, const struct iovec *iov, int iovcnt), (fd, iov, iovcnt))
+FORWARD(int, poll, (struct pollfd *fds, nfds_t nfds, int timeout), (fds, nfds, timeout))
+FORWARD(int, usleep, (useconds_t usec), (usec))
+
+extern "C" long syscall(long number, ...) {
+    static long (*real)(long, ...) = (long (*)(long, ...))dlsym(RTLD_NEXT, "syscall");
+    va_list ap;
+    va_start(ap, number);
+    long a[6];
+    for (int i = 0; i < 6; i++)
+        a[i] = va_arg(ap, long);
+    va_end(ap);
+    if (counting) syscallCount++;
+    return real(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+enum Mode { CLASSIC, URING_SYNC, URING_BATCH };
+
+struct Result {
+    double syscallsPerFrame;
+    double cpuMsPer1000;
+    double wallMs;
+};
+
+// Echo every byte received on the masters until the parent closes the ports
+static void simulateBoards(std::vector<int> &masters) {
+    std::vector<struct pollfd> pfds(masters.size());
+    for (size_t i = 0; i < masters.size(); i++)
+        pfds[i] = {masters[i], POLLIN, 0};
+    char buffer[256];
+    size_t open = masters.size();
+    while (open > 0) {
+        if (poll(pfds.data(), pfds.size(), -1) < 0)
+            continue;
+        for (auto &pfd : pfds) {
+            if (pfd.fd < 0 || pfd.revents == 0)
+                continue;
+            ssize_t n = read(pfd.fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                pfd.fd = -1;
+                open--;
+                continue;
+            }
+            write(pfd.fd, buffer, n);
+        }
+    }
+    _exit(0);
+}
+
+static double cpuMs() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3
+         + usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+}
+
+static bool run(int nports, Mode mode, int frames, serialUring *engine, Result &result) {
+    std::vector<int> masters;
+    std::vector<serialib> ports(nports);
+    for (int i = 0; i < nports; i++) {
+        int master, slave;
+        char name[64];
+        if (openpty(&master, &slave, name, NULL, NULL) != 0)
+            return false;
+        if (ports[i].openDevice(name, 115200) != 1)
+            return false;
+        close(slave);
+        masters.push_back(master);
+        if (mode == URING_SYNC)
+            ports[i].setIoEngine(engine);
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        // The boards must see the hang up when the parent closes the ports
+        for (auto &port : ports)
+            port.closeDevice();
+        simulateBoards(masters);
+    }
+    for (int master : masters)
+        close(master);
+
+    const char frame[4] = {(char)0xA0, 1, 1, (char)0xA2};
+    std::vector<char> rx(nports * 4);
+    std::vector<int> received(nports);
+    std::vector<serialCompletion> completions(nports * 2);
+    struct iovec iov = {(void *)frame, sizeof(frame)};
+    int rounds = frames / nports > 0 ? frames / nports : 1;
+    bool ok = true;
+
+    timeOut wall;
+    wall.initTimer();
+    double cpuStart = cpuMs();
+    syscallCount = 0;
+    counting = true;
+    for (int r = 0; r < rounds && ok; r++) {
+        if (mode == URING_BATCH) {
+            // One write and one read per port, submitted and reaped together
+            for (int i = 0; i < nports; i++) {
+                received[i] = 0;
+                engine->queueWrite(ports[i].getFileDescriptor(), &iov, 1, 500, 2 * i);
+                engine->queueRead(ports[i].getFileDescriptor(), &rx[4 * i], 4, 500, 2 * i + 1);
+            }
+            while (engine->pending() > 0 && ok) {
+                int n = engine->wait(completions.data(), completions.size(), 1);
+                for (int k = 0; k < n; k++) {
+                    int i = completions[k].tag / 2;
+                    if (completions[k].result <= 0) {
+                        ok = false;
+                        break;
+                    }
+                    if (completions[k].tag % 2 == 0)
+                        continue;
+                    received[i] += completions[k].result;
+                    if (received[i] < 4)
+                        engine->queueRead(ports[i].getFileDescriptor(), &rx[4 * i + received[i]],
+                                          4 - received[i], 500, 2 * i + 1);
+                }
+            }
+        } else {
+            for (int i = 0; i < nports && ok; i++)
+                ok = ports[i].writeBytes(frame, sizeof(frame)) == 1;
+            // Same read call in both modes: readChar waits through the engine when one is
+            // attached, with poll otherwise, and takes every byte available in one read
+            for (int i = 0; i < nports && ok; i++)
+                for (int k = 0; k < 4 && ok; k++)
+                    ok = ports[i].readChar(&rx[4 * i + k], 500) == 1;
+        }
+    }
+    counting = false;
+    double cpu = cpuMs() - cpuStart;
+    unsigned long elapsed = wall.elapsedTime_ms();
+
+    for (auto &port : ports)
+        port.closeDevice();
+    waitpid(child, NULL, 0);
+
+    int total = rounds * nports;
+    result.syscallsPerFrame = (double)syscallCount / total;
+    result.cpuMsPer1000 = cpu * 1000.0 / total;
+    result.wallMs = elapsed;
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int frames = argc > 1 ? std::stoi(argv[1]) : 2048;
+
+    serialUring engine;
+    bool uring = engine.open(256) == 1;
+    if (!uring)
+        std::cout << "io_uring not available, classic path only" << std::endl;
+
+    const char *names[] = {"classic", "uring", "uring-batch"};
+    std::cout << std::left << std::setw(8) << "ports" << std::setw(14) << "engine"
+              << std::setw(18) << "syscalls/frame" << std::setw(20) << "cpu ms/1000 frames"
+              << "wall ms" << std::endl;
+    for (int nports : {1, 16, 64}) {
+        for (Mode mode : {CLASSIC, URING_SYNC, URING_BATCH}) {
+            if (mode != CLASSIC && !uring)
+                continue;
+            Result result;
+            if (!run(nports, mode, frames, &engine, result)) {
+                std::cout << std::setw(8) << nports << std::setw(14) << names[mode] << "failed" << std::endl;
+                continue;
+            }
+            std::cout << std::setw(8) << nports << std::setw(14) << names[mode]
+                      << std::setw(18) << std::fixed << std::setprecision(2) << result.syscallsPerFrame
+                      << std::setw(20) << result.cpuMsPer1000 << result.wallMs << std::endl;
+        }
+    }
+    return 0;
+}
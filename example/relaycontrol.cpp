@@ -1,80 +1,347 @@
 #include <usbmrelay.hpp>
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 
 
+// Batch control of a relay board: reads commands from stdin or a file, one per line, and
+// applies them through the fast paths of Usbmrelay. Consecutive switch commands are merged
+// into one target state, applied when a barrier command (sleep, status, flush, init,
+// emergency) or the end of the input is reached: only the relays which change get a frame,
+// sent in one write when the delay is 0.
+//
+// usbrelay <port> [relaynumber] [--file F] [--delay ms] [--state-file F] [--rate-limit ms]
+//          [--no-coalesce] [--timing] [--mirror NAME] [--realtime] [--cpu N]
+// usbrelay --scan
+//
+// With --realtime the commands run with a SCHED_FIFO priority and the memory locked, pinned
+// to CPU N with --cpu. The command loop does not allocate: the line buffer is reserved for
+// lines up to 4096 bytes, and the commands are parsed in place.
+//
+// Commands (# starts a comment):
+//   on <relay>...        switch relays on, relays are numbered from 1
+//   off <relay>...       switch relays off
+//   toggle <relay>...    switch relays to the opposite state
+//   set <mask>           set every relay, bit i for relay i+1 (decimal or 0x hexadecimal)
+//   all on|off           switch every relay
+//   sleep <ms>           apply the pending switches, then wait until <ms> after the end of
+//                        the previous sleep, so that a timed sequence does not drift; if that
+//                        end is more than <ms> ago, wait <ms> from now
+//   status               apply the pending switches, then print the state of each relay
+//   flush                apply the pending switches
+//   init                 initialize the board
+//   emergency            switch every relay off from the urgent lane
+
+void usage(){
+    std::cerr << "usage: usbrelay <port> [relaynumber] [--file F] [--delay ms] [--state-file F]"
+              << " [--rate-limit ms] [--no-coalesce] [--timing] [--mirror NAME] [--realtime] [--cpu N]" << std::endl;
+    std::cerr << "       usbrelay --scan" << std::endl;
+}
+
 void printStatus(Usbmrelay *usbmrelay){ //Format for terminal usb board relays status
     std::cout<<"=====Board Status====="<<std::endl;
-    std::vector<int> status= usbmrelay->getState();
+    uint64_t status = usbmrelay->getStateMask();
     int relaynumber = usbmrelay->getRelayNumber();
     for(int i=1;i<=relaynumber;i++){
-        int kstate = status[i-1]; 
+        int kstate = (status >> (i-1)) & 1;
         if(kstate){
-            std::cout<<"K"+std::to_string(i)+": "+"ON"<<std::endl;
+            std::cout<<"K"<<i<<": ON"<<std::endl;
         }
         else{
-            std::cout<<"K"+std::to_string(i)+": "+"OFF"<<std::endl;
+            std::cout<<"K"<<i<<": OFF"<<std::endl;
         }
     }
 }
 
+struct Batch { //Switch commands merged since the last apply
+    uint64_t target;
+    int firstline;
+    int lastline;
+    int commands;
+};
+
+//Applies the merged target state, prints its timing on request
+int apply(Usbmrelay *usbmrelay, Batch &batch, bool timing){
+    if(batch.commands == 0)
+        return 1;
+    uint64_t before = usbmrelay->getStateMask();
+    auto start = std::chrono::steady_clock::now();
+    int status = usbmrelay->setStateMask(batch.target);
+    double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    if(timing){
+        if(batch.firstline == batch.lastline)
+            std::cout << "line " << batch.firstline << ": ";
+        else
+            std::cout << "lines " << batch.firstline << "-" << batch.lastline << ": ";
+        std::cout << batch.commands << " commands, " << std::popcount(before ^ usbmrelay->getStateMask()) << " relays switched in "
+                  << elapsed << " us" << std::endl;
+    }
+    batch.commands = 0;
+    return status;
+}
+
+//Takes the next word of a command line, empty at the end of the line
+std::string_view nextWord(std::string_view &args){
+    size_t start = args.find_first_not_of(" \t\r");
+    if(start == std::string_view::npos){
+        args = std::string_view();
+        return args;
+    }
+    size_t end = std::min(args.find_first_of(" \t\r", start), args.size());
+    std::string_view word = args.substr(start, end - start);
+    args.remove_prefix(end);
+    return word;
+}
+
+//Parses a whole word as a number, decimal, 0x hexadecimal or 0 octal
+template <typename T>
+bool parseNumber(std::string_view word, T &value, bool prefixes = false){
+    int base = 10;
+    if(prefixes && word.size() > 2 && word[0] == '0' && (word[1] == 'x' || word[1] == 'X')){
+        base = 16;
+        word.remove_prefix(2);
+    }
+    else if(prefixes && word.size() > 1 && word[0] == '0')
+        base = 8;
+    auto result = std::from_chars(word.data(), word.data() + word.size(), value, base);
+    return !word.empty() && result.ec == std::errc() && result.ptr == word.data() + word.size();
+}
+
+//Parses the relays of an on/off/toggle command
+bool parseRelays(std::string_view args, int relaynumber, uint64_t &relays){
+    relays = 0;
+    for(std::string_view word = nextWord(args); !word.empty(); word = nextWord(args)){
+        int relay;
+        if(!parseNumber(word, relay) || relay < 1 || relay > relaynumber)
+            return false;
+        relays |= 1ULL << (relay - 1);
+    }
+    return relays != 0;
+}
 
-int main(){
+int main(int argc, char** argv){
+    std::ios::sync_with_stdio(false);
+    if(argc >= 2 && std::string(argv[1]) == "--scan"){
+        auto devicescan = scanBoard(); //Scan online COM or /dev/tty... device
+        for( auto device : devicescan){
+            std::cout << device << std::endl;
+        }
+        return 0;
+    }
+    if(argc < 2 || argv[1][0] == '-'){
+        usage();
+        return 2;
+    }
+
+    std::string port = argv[1];
+    int relaynumber = 8;
+    std::string inputfile, statefile, mirrorname;
+    int delay = -1; //Default: the delay of the library
+    unsigned int ratelimit = 0;
+    bool coalesce = true, timing = false, realtime = false;
+    RealtimeConfig rtconfig;
+    int i = 2;
+    if(i < argc && argv[i][0] != '-')
+        relaynumber = std::stoi(argv[i++]);
+    for(; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg == "--file" && i + 1 < argc)
+            inputfile = argv[++i];
+        else if(arg == "--delay" && i + 1 < argc)
+            delay = std::stoi(argv[++i]);
+        else if(arg == "--state-file" && i + 1 < argc)
+            statefile = argv[++i];
+        else if(arg == "--rate-limit" && i + 1 < argc)
+            ratelimit = std::stoul(argv[++i]);
+        else if(arg == "--mirror" && i + 1 < argc)
+            mirrorname = argv[++i];
+        else if(arg == "--no-coalesce")
+            coalesce = false;
+        else if(arg == "--timing")
+            timing = true;
+        else if(arg == "--realtime")
+            realtime = true;
+        else if(arg == "--cpu" && i + 1 < argc)
+            rtconfig.cpu = std::stoi(argv[++i]);
+        else{
+            usage();
+            return 2;
+        }
+    }
 
-    auto devicescan = scanBoard(); //Scan online COM or /dev/tty... device 
-    std::cout << "=====Scanned Device=====" << std::endl; 
-    for( auto device : devicescan){
-        std::cout << device << std::endl;
+    std::ifstream file;
+    if(!inputfile.empty()){
+        file.open(inputfile);
+        if(!file){
+            std::cerr << "Cannot read " << inputfile << std::endl;
+            return 2;
+        }
     }
-    
-    //Connection and init to the board
-    std::cout << "=====Connection======" << std::endl;
-    
-    Usbmrelay* usbmrelay = new Usbmrelay("COM7",8); //Create a new board, please specify: port, default relaynumber 
-    
+    std::istream &input = inputfile.empty() ? std::cin : file;
+
+    //Connection to the board, initialized by the first command if needed
+    std::unique_ptr<Usbmrelay> usbmrelay = std::make_unique<Usbmrelay>(port, relaynumber);
+    usbmrelay->setStateFile(statefile); //Keep the relay states and init status across runs
     if(usbmrelay->openCom()!=1){//Open commmunication with the board
-        std::cout << "Connection Failed" << std::endl;
-        return -1;   
+        std::cerr << "Connection Failed" << std::endl;
+        return 1;
+    }
+    relaynumber = usbmrelay->getRelayNumber();
+    if(delay >= 0)
+        usbmrelay->setDelay(delay);
+    for(int relay = 1; ratelimit > 0 && relay <= relaynumber; relay++)
+        usbmrelay->setRateLimit(relay, ratelimit);
+    RelayStateMirror mirror; //Relay states for usbrelay_status, while the batch runs
+    if(!mirrorname.empty() && (mirror.open(mirrorname, 1) != 1 || usbmrelay->setMirror(&mirror, 0) != 1)){
+        std::cerr << "Cannot create the mirror " << mirrorname << std::endl;
+        return 1;
     }
-    string choice;
-    std::cout << "Board Already initialized?(y/n):";
-    std::cin >> choice;
-    if(choice == "N" || choice == "n"){
-        if (usbmrelay->initBoard()!=1){ //Init communication protocol with the board, can be initialized only once after power reset
-            std::cout << "Init Failed" << std::endl;
-            return -1;
+    uint64_t allrelays = relaynumber >= 64 ? ~0ULL : (1ULL << relaynumber) - 1;
+
+    //The commands are run by this thread: SCHED_FIFO, memory locked, once the board is set up.
+    //The line buffer is reserved first, the loop below does not allocate.
+    std::string line;
+    line.reserve(4096);
+    RealtimeStatus rtstatus;
+    if(realtime && enterRealtime(rtconfig, &rtstatus) != 1)
+        std::cerr << "Real-time mode partly refused:" << (rtconfig.priority > 0 && !rtstatus.scheduler ? " scheduler" : "")
+                  << (rtconfig.cpu >= 0 && !rtstatus.affinity ? " affinity" : "")
+                  << (rtconfig.lockmemory && !rtstatus.memory ? " memory lock" : "") << std::endl;
+
+    Batch batch = {usbmrelay->getStateMask(), 0, 0, 0};
+    TimePoint schedule; //Deadline of the last sleep, the timeline of the sleep commands
+    bool scheduled = false;
+    int linenumber = 0, errors = 0;
+    auto start = std::chrono::steady_clock::now();
+    while(std::getline(input, line)){
+        linenumber++;
+        std::string_view args(line);
+        args = args.substr(0, args.find('#'));
+        std::string_view command = nextWord(args);
+        if(command.empty())
+            continue;
+
+        //Switch commands update the target state
+        uint64_t relays;
+        bool switched = true;
+        if(command == "on" || command == "off" || command == "toggle"){
+            if(!parseRelays(args, relaynumber, relays)){
+                std::cerr << "line " << linenumber << ": expected relays from 1 to " << relaynumber << std::endl;
+                errors++;
+                continue;
+            }
+            if(command == "on")
+                batch.target |= relays;
+            else if(command == "off")
+                batch.target &= ~relays;
+            else
+                batch.target ^= relays;
+        }
+        else if(command == "set"){
+            uint64_t mask;
+            if(!parseNumber(nextWord(args), mask, true) || !nextWord(args).empty()){
+                std::cerr << "line " << linenumber << ": expected a mask" << std::endl;
+                errors++;
+                continue;
+            }
+            batch.target = mask & allrelays;
+        }
+        else if(command == "all"){
+            std::string_view value = nextWord(args);
+            if(value != "on" && value != "off"){
+                std::cerr << "line " << linenumber << ": expected all on|off" << std::endl;
+                errors++;
+                continue;
+            }
+            batch.target = value == "on" ? allrelays : 0;
+        }
+        else
+            switched = false;
+        if(switched){
+            if(batch.commands == 0)
+                batch.firstline = linenumber;
+            batch.lastline = linenumber;
+            batch.commands++;
+            if(!coalesce && apply(usbmrelay.get(), batch, timing) != 1){
+                std::cerr << "line " << linenumber << ": write failed" << std::endl;
+                errors++;
+            }
+            continue;
+        }
+
+        //Barrier commands apply the pending switches first
+        if(command != "emergency" && apply(usbmrelay.get(), batch, timing) != 1){
+            std::cerr << "line " << batch.lastline << ": write failed" << std::endl;
+            errors++;
         }
+        if(command == "sleep"){
+            unsigned long milliseconds;
+            if(parseNumber(nextWord(args), milliseconds)){
+                TimePoint now = SteadyClock::now();
+                //The first sleep starts the timeline, and so does a sleep already late by more than
+                //its duration (a pause of an interactive session): it waits the full duration
+                if(!scheduled || now - schedule > std::chrono::milliseconds(milliseconds))
+                    schedule = now;
+                scheduled = true;
+                schedule += std::chrono::milliseconds(milliseconds);
+                sleepUntil(schedule);
+            }
+            else{
+                std::cerr << "line " << linenumber << ": missing duration" << std::endl;
+                errors++;
+            }
+        }
+        else if(command == "status"){
+            printStatus(usbmrelay.get()); //print the status of each relays
+        }
+        else if(command == "flush"){
+            if(usbmrelay->flushPending() != 1)
+                errors++;
+        }
+        else if(command == "init"){
+            if (usbmrelay->initBoard()!=1){
+                std::cerr << "line " << linenumber << ": init failed" << std::endl;
+                errors++;
+            }
+        }
+        else if(command == "emergency"){
+            batch.commands = 0; //The pending switches are obsolete
+            if(usbmrelay->emergencyOff() != 1){
+                std::cerr << "line " << linenumber << ": emergency off failed" << std::endl;
+                errors++;
+            }
+        }
+        else{
+            std::cerr << "line " << linenumber << ": unknown command " << command << std::endl;
+            errors++;
+        }
+        uint64_t pending = usbmrelay->getPendingMask(); //Held back by the rate limit, still wanted
+        batch.target = (usbmrelay->getStateMask() & ~pending) | (batch.target & pending);
+    }
+    if(apply(usbmrelay.get(), batch, timing) != 1){
+        std::cerr << "line " << batch.lastline << ": write failed" << std::endl;
+        errors++;
     }
-    
- 
-    //Info function
-    std::cout << "=====Device Data=====" << std::endl;
-    std::cout << "Port Name:" << std::endl;
-    std::cout << usbmrelay->getPort() << std::endl;
-    std::cout << "Relay Numbner:" << std::endl;
-    std::cout << usbmrelay->getRelayNumber() << std::endl;
-    std::cout << "Baudrate" << std::endl;
-    std::cout << usbmrelay->getSpeed() << std::endl;
-    
-
-    //Create Command array for 8 relays board 
-    int command1 [] = {1,1,1,1,0,0,0,0}; //Create command activate K1,K2,K3,K4 and deactivate all other relays 
-    int command2 = 0xf0;     //Create command activate K5,K6,K7,K8 and deactivate all other relays
-    
-    
-    for(int k=0;k<=10;k++){
-        if(usbmrelay->setState(command1)!=1)//Change the state of the board with setState(int*)
-            return -1; 
-        printStatus(usbmrelay); //print the status of each relays 
-        os_sleep(1000); //os specific sleep
-        if(usbmrelay->setState(command2)!=1)//Change the state of the board with setState(int)
-            return -1; 
-        printStatus(usbmrelay); //print the status of each relays
-        os_sleep(1000); //os specific sleep
+    //Switches held back by the rate limit are sent once the relays get their tokens back
+    for(long wait = usbmrelay->pendingDelay(); wait >= 0; wait = usbmrelay->pendingDelay()){
+        os_sleep(wait);
+        if(usbmrelay->flushPending() != 1){
+            errors++;
+            break;
+        }
     }
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if(timing)
+        std::cout << linenumber << " lines in " << elapsed << " ms" << std::endl;
+    usbmrelay->setMirror(nullptr, 0);
     usbmrelay->closeCom();
+    return errors ? 1 : 0;
 }
-
-
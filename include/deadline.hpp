@@ -0,0 +1,36 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+
+
+using SteadyClock = std::chrono::steady_clock;
+using TimePoint = SteadyClock::time_point;
+
+// Blocks the calling thread until an absolute deadline of the steady clock. A sequence of
+// deadlines computed from one start does not drift, whatever the lateness of each wake-up.
+// On Linux the thread sleeps in clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME), then spins
+// for the last spinus microseconds, trading CPU time for a wake-up within a microsecond.
+// Returns: how late the deadline was met, in nanoseconds, 0 if it was not missed
+int64_t sleepUntil(TimePoint deadline, unsigned int spinus = 0);
+
+// Series of deadlines spaced by a fixed period from a start time, for periodic work
+class PeriodicDeadline
+{
+public:
+    PeriodicDeadline(std::chrono::nanoseconds period, TimePoint start = SteadyClock::now());
+
+    // Sleeps until the next deadline, see sleepUntil. The deadlines missed by more than a
+    // period are skipped, so that a stall is not followed by a burst.
+    // Returns: how late the deadline was met, in nanoseconds
+    int64_t wait(unsigned int spinus = 0);
+    // The deadline the next call to wait sleeps until
+    TimePoint next();
+    // Number of deadlines skipped since the start
+    uint64_t getMissed();
+
+private:
+    std::chrono::nanoseconds period;
+    TimePoint deadline;
+    uint64_t missed = 0;
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+
+// Bounded lock-free queue for many producer threads and one consumer thread.
+// Each cell carries a sequence number telling whether it is free for the producer at a given
+// position or holds a value for the consumer, so that a push is one compare-and-swap on the
+// tail plus two stores, and a pop takes no atomic read-modify-write at all.
+// Capacity must be a power of two.
+template <typename T, size_t Capacity>
+class MpscQueue
+{
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+    MpscQueue() {
+        for (size_t i = 0; i < Capacity; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    // Appends a value, from any thread
+    // Returns: true if the value is queued, false if the queue is full
+    bool push(const T& value) {
+        uint64_t position = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & (Capacity - 1)];
+            uint64_t sequence = cell.sequence.load(std::memory_order_acquire);
+            int64_t diff = (int64_t)(sequence - position);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    cell.value = value;
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                return false; // The consumer has not freed this cell yet
+            }
+            else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Removes the oldest value, from the consumer thread only
+    // Returns: true if a value is returned, false if the queue is empty
+    bool pop(T& value) {
+        Cell& cell = cells[head & (Capacity - 1)];
+        if (cell.sequence.load(std::memory_order_acquire) != head + 1)
+            return false;
+        value = cell.value;
+        cell.sequence.store(head + Capacity, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<uint64_t> sequence;
+        T value;
+    };
+
+    Cell cells[Capacity];
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) uint64_t head = 0;
+};
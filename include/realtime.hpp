@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#if defined (__linux__)
+#include <pthread.h>
+#else
+#include <mutex>
+#endif
+
+
+
+// Real-time settings of the thread driving the boards, see enterRealtime
+struct RealtimeConfig {
+    int priority = 50; // SCHED_FIFO priority from 1 to 99, 0 to keep the normal scheduler
+    int cpu = -1; // CPU the thread is pinned to, -1 to let it run on any CPU
+    bool lockmemory = true; // Lock the pages of the process in memory (mlockall)
+    size_t prefaultstack = 256 * 1024; // Bytes of stack touched in advance, 0 for none
+};
+
+// What enterRealtime managed to apply, each step can be refused by the system
+struct RealtimeStatus {
+    bool scheduler = false; // SCHED_FIFO is active
+    bool affinity = false; // The thread is pinned
+    bool memory = false; // The memory is locked
+};
+
+// Switches the calling thread to real-time execution: SCHED_FIFO priority, CPU pinning and
+// memory locked with a prefaulted stack, so that neither the scheduler nor a page fault can
+// delay it. Buffers allocated afterwards should be prefaulted too. The thread must then
+// avoid allocating, and must block regularly: a busy SCHED_FIFO thread starves its CPU.
+// Linux only, needs CAP_SYS_NICE and CAP_IPC_LOCK or the matching rlimits.
+// Returns: 1 if every requested setting is applied, -1 otherwise (see status)
+int enterRealtime(const RealtimeConfig& config = RealtimeConfig(), RealtimeStatus* status = nullptr);
+
+// Returns the calling thread to the normal scheduler on any CPU, the memory stays locked
+void leaveRealtime();
+
+// Touches every page of a buffer, so that its first use does not fault
+void prefault(void* buffer, size_t size);
+
+// Mutex with priority inheritance (PTHREAD_PRIO_INHERIT, Linux only): a thread holding it runs
+// at the priority of the highest priority thread waiting for it, so that a real-time thread
+// does not wait behind a normal thread preempted while holding it. A plain mutex elsewhere,
+// or if the system refuses the protocol. Usable with std::lock_guard and std::unique_lock.
+class PriorityMutex
+{
+
+public:
+
+    PriorityMutex();
+    ~PriorityMutex();
+    PriorityMutex(const PriorityMutex&) = delete;
+    PriorityMutex& operator=(const PriorityMutex&) = delete;
+    void lock();
+    bool try_lock();
+    void unlock();
+
+private:
+
+#if defined (__linux__)
+    pthread_mutex_t mutex;
+#else
+    std::mutex mutex;
+#endif
+};
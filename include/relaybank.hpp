@@ -0,0 +1,50 @@
+#pragma once
+#include <usbmrelay.hpp>
+#include <relayfleet.hpp>
+#include <scheduler.hpp>
+#include <bitset>
+#include <vector>
+
+
+
+// Largest number of channels in a bank
+#define RELAYBANK_MAX_CHANNELS 1024
+
+// State of the channels of a bank, bit c for channel c
+typedef std::bitset<RELAYBANK_MAX_CHANNELS> RelayBankMask;
+
+// Several boards seen as one bank of channels numbered from 0: the relays of the first board
+// added, then those of the next one. A change of the bank is split into one delta per board,
+// and the boards which change are written concurrently by coroutines on the calling thread,
+// so a change spanning every board takes about the time of one board.
+class RelayBank
+{
+
+public:
+
+    RelayBank();
+    int addBoard(Usbmrelay* board);
+    int addFleet(RelayFleet& fleet);
+    int size();
+    int getBoardCount();
+    int locate(int channel, int& board, int& relay);
+    int setStateMask(const RelayBankMask& state);
+    int setStateMask(const RelayBankMask& state, const RelayBankMask& channels);
+    int toggle(const RelayBankMask& channels);
+    int setChannel(int channel, bool on);
+    RelayBankMask getStateMask();
+    bool getChannel(int channel);
+
+private:
+
+    Task<void> writeBoard(int index, uint64_t state, uint64_t relays, int& status);
+    uint64_t slice(const RelayBankMask& mask, int index);
+
+    struct Board {
+        Usbmrelay* board;
+        int first; // First channel of the board
+        int relaynumber;
+    };
+    std::vector<Board> boards;
+    int channels = 0;
+};
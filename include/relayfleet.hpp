@@ -0,0 +1,49 @@
+#pragma once
+#include <usbmrelay.hpp>
+#include <scheduler.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+
+// Configuration of one board of a fleet
+struct RelayBoardConfig {
+    std::string port;
+    int relaynumber = 8;
+    int delay = -1; // Inter-frame delay in milliseconds, -1 to keep the default or the calibrated one
+    std::string statefile; // State file of the board, empty for none
+};
+
+// Readiness of one board, reported by RelayFleet::bootstrap as soon as the board is done
+struct RelayBoardReady {
+    int index; // Index of the board in the fleet
+    int status; // 1 if the board is ready, -1 if the port did not open, -2 if the init failed
+    bool initialized; // true if the board was initialized, false if it kept its state
+    double readyms; // Time from the start of the bootstrap, in milliseconds
+};
+
+typedef std::function<void(const RelayBoardReady&)> RelayReadyCallback;
+
+// Set of boards opened and initialized together. The boards are opened one after the other,
+// which is fast, then initialized concurrently by coroutines on a single thread, so the
+// startup of a fleet takes about the init time of one board.
+class RelayFleet
+{
+
+public:
+
+    RelayFleet();
+    int add(const RelayBoardConfig& config);
+    int bootstrap(const RelayReadyCallback& ready = RelayReadyCallback());
+    int size();
+    Usbmrelay* board(int index);
+
+private:
+
+    Task<void> bootBoard(int index, TimePoint start, const RelayReadyCallback& ready, int& nready);
+
+    std::vector<RelayBoardConfig> configs;
+    std::vector<std::unique_ptr<Usbmrelay>> boards;
+};
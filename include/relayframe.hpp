@@ -0,0 +1,131 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+
+// First byte of every LCUS frame: 0xA0, channel, state, checksum
+#define RELAYFRAME_HEADER 0xA0
+#define RELAYFRAME_SIZE 4
+
+// Validated frame handed to the handler of RelayFrameParser::feed
+struct RelayFrame {
+    const unsigned char* bytes; // The 4 bytes of the frame, valid during the handler call only
+    int channel; // Relay number, from 1
+    int state; // State byte of the frame
+};
+
+// Counters of a RelayFrameParser
+struct RelayFrameStats {
+    uint64_t frames = 0; // Valid frames
+    uint64_t checksumerrors = 0; // Frames dropped because of their checksum or channel
+    uint64_t discardedbytes = 0; // Bytes skipped to find the next header
+};
+
+// Streaming parser of LCUS frames. Chunks of any size are fed straight from the read buffer:
+// the frames inside a chunk are validated and handed out in place, without copy, and only the
+// up to 3 bytes of a frame split across two chunks are kept. After garbage or a bad checksum,
+// the parser resynchronizes on the next header byte.
+class RelayFrameParser
+{
+
+public:
+
+    // Parameters: maxchannel - the largest valid channel, frames for other channels are dropped
+    explicit RelayFrameParser(int maxchannel = 255) : maxchannel(maxchannel) {}
+
+    // Parses a chunk of bytes
+    // Parameters: data - the bytes, they only need to stay valid during the call
+    //             size - the number of bytes
+    //             handler - called with a const RelayFrame& for each valid frame
+    // Returns: the number of valid frames in the chunk
+    template <typename Handler>
+    size_t feed(const char* data, size_t size, Handler&& handler) {
+        const unsigned char* bytes = (const unsigned char*)data;
+        const unsigned char* end = bytes + size;
+        size_t frames = 0;
+
+        // Complete the frame started by the previous chunk
+        while (pendingsize > 0 && bytes < end) {
+            pending[pendingsize++] = *bytes++;
+            if (pendingsize < RELAYFRAME_SIZE)
+                continue;
+            if (accept(pending, handler)) {
+                frames++;
+                pendingsize = 0;
+            }
+            else
+                resync(); // Look for a header in the 3 bytes after the bad one
+        }
+
+        // Frames inside the chunk are checked in place
+        while (bytes < end) {
+            if (*bytes != RELAYFRAME_HEADER) {
+                const unsigned char* header = (const unsigned char*)memchr(bytes, RELAYFRAME_HEADER, end - bytes);
+                if (header == nullptr) {
+                    stats.discardedbytes += end - bytes;
+                    return frames;
+                }
+                stats.discardedbytes += header - bytes;
+                bytes = header;
+            }
+            if (end - bytes < RELAYFRAME_SIZE) {
+                pendingsize = end - bytes;
+                memcpy(pending, bytes, pendingsize);
+                return frames;
+            }
+            if (accept(bytes, handler)) {
+                frames++;
+                bytes += RELAYFRAME_SIZE;
+            }
+            else {
+                stats.discardedbytes++;
+                bytes++;
+            }
+        }
+        return frames;
+    }
+
+    // Drops the bytes of an incomplete frame, after a reconnection for example
+    void reset() {
+        stats.discardedbytes += pendingsize;
+        pendingsize = 0;
+    }
+
+    // Returns: the counters since the construction of the parser
+    const RelayFrameStats& getStats() const {
+        return stats;
+    }
+
+private:
+
+    // Validates 4 bytes starting with a header and hands them to the handler
+    // Returns: true if the frame is valid
+    template <typename Handler>
+    bool accept(const unsigned char* frame, Handler& handler) {
+        if ((unsigned char)(frame[0] + frame[1] + frame[2]) != frame[3] || frame[1] == 0 || frame[1] > maxchannel) {
+            stats.checksumerrors++;
+            return false;
+        }
+        stats.frames++;
+        RelayFrame parsed = {frame, frame[1], frame[2]};
+        handler(parsed);
+        return true;
+    }
+
+    // Drops the header of the invalid pending frame and keeps the bytes from the next header
+    void resync() {
+        int next = 1;
+        while (next < pendingsize && pending[next] != RELAYFRAME_HEADER)
+            next++;
+        stats.discardedbytes += next;
+        pendingsize -= next;
+        memmove(pending, pending + next, pendingsize);
+    }
+
+    int maxchannel;
+    unsigned char pending[RELAYFRAME_SIZE]; // Start of a frame split across chunks
+    int pendingsize = 0;
+    RelayFrameStats stats;
+};
@@ -0,0 +1,84 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+
+// Largest number of boards in a mirror
+#define RELAYMIRROR_MAX_BOARDS 1024
+
+// Attempts of a read on a slot being written before it is reported busy, see RelayStateMirrorReader::read
+#define RELAYMIRROR_READ_RETRIES 1000
+
+// Snapshot of one board read from a mirror
+struct RelayMirrorSnapshot {
+    uint64_t state; // Relay states, bit i for relay i+1
+    uint64_t sequence; // Number of states published since the board was attached, the first one included
+    uint64_t timestamp_ns; // Time of the last change, nanoseconds since the epoch
+    int relaynumber;
+    char port[64];
+};
+
+// Shared memory segment where the process owning the boards publishes their relay states.
+// Each board has a slot protected by a seqlock: a publish is a few stores, and the readers,
+// in any process, take consistent snapshots without locks or system calls. The writers take
+// the seqlock with a compare-and-swap, so a slot never has two writers at once.
+class RelayStateMirror
+{
+
+public:
+
+    RelayStateMirror();
+    ~RelayStateMirror();
+    int open(const std::string& name, int boardcount);
+    void close();
+    bool isOpen();
+    int describe(int slot, const std::string& port, int relaynumber);
+    int publish(int slot, uint64_t state);
+
+    struct Slot {
+        std::atomic<uint32_t> seqlock; // Odd while the slot is written
+        std::atomic<int32_t> relaynumber; // 0 if no board uses the slot
+        std::atomic<uint64_t> state;
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint64_t> timestamp_ns;
+        char port[64];
+        char reserved[32];
+    };
+    struct Layout {
+        char magic[8];
+        uint32_t version;
+        uint32_t boardcount;
+        int32_t ownerpid; // Process publishing to the segment
+        char reserved[44];
+        Slot slots[1];
+    };
+
+private:
+
+    Layout* segment = nullptr;
+    size_t size = 0;
+    std::string name;
+};
+
+// Read side of a RelayStateMirror, for dashboards and loggers
+class RelayStateMirrorReader
+{
+
+public:
+
+    RelayStateMirrorReader();
+    ~RelayStateMirrorReader();
+    int open(const std::string& name);
+    void close();
+    int getBoardCount();
+    bool isOwnerAlive();
+    int read(int slot, RelayMirrorSnapshot& snapshot);
+
+private:
+
+    const RelayStateMirror::Layout* segment = nullptr;
+    size_t size = 0;
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+
+
+// Small memory-mapped file keeping the shadow state of a relay board across restarts.
+// The file holds two slots written alternately; each slot carries a sequence number and
+// a checksum, so a torn update never hides the previous valid snapshot.
+class RelayStateStore
+{
+
+public:
+
+    RelayStateStore();
+    ~RelayStateStore();
+    int open(const std::string& path, const std::string& device, int relaynumber);
+    void close();
+    bool isOpen();
+    int load(uint64_t& state, bool& initialized, uint64_t& devicestamp);
+    int save(uint64_t state, bool initialized, uint64_t devicestamp);
+    int loadDelay(int& delay);
+    int saveDelay(int delay);
+
+private:
+
+    struct Slot {
+        uint64_t sequence;
+        uint64_t state;
+        uint64_t devicestamp;
+        uint32_t initialized;
+        uint32_t checksum;
+    };
+    struct Layout {
+        char magic[8];
+        uint32_t version;
+        uint32_t relaynumber;
+        int32_t delay; // Calibrated inter-frame delay in milliseconds, -1 if unknown
+        uint32_t reserved;
+        char device[64];
+        Slot slots[2];
+    };
+
+    static uint32_t checksum(const Slot& slot);
+    const Slot* latest();
+
+    Layout* file = nullptr;
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <usbmrelay.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+
+
+// Controller-side watchdog: if the application stops feeding it, a monitor thread switches
+// every relay of the watched boards off. The monitor writes frames encoded in advance straight
+// to the ports, without allocating or locking, so it works even when the thread which hung
+// holds a board.
+class RelayWatchdog
+{
+
+public:
+
+    RelayWatchdog();
+    ~RelayWatchdog();
+    int addBoard(Usbmrelay* board);
+    int start(unsigned int timeoutms);
+    void stop();
+    bool hasTripped();
+    uint64_t getTripCount();
+
+    // Signals that the application is alive: one clock read and one atomic store
+    void feed() {
+        lastfeed.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count(), std::memory_order_release);
+    }
+
+private:
+
+    void monitor();
+    void failSafe();
+
+    std::vector<Usbmrelay*> boards;
+    std::thread thread;
+    std::atomic<int64_t> lastfeed{0}; // Steady clock time of the last feed, in nanoseconds
+    std::atomic<bool> running{false};
+    std::atomic<bool> tripped{false};
+    std::atomic<uint64_t> trips{0};
+    int64_t timeout_ns = 0;
+    std::vector<RelayFailSafePlan> plans; // Fail-safe frame plan of each board, taken by failSafe
+};
@@ -0,0 +1,162 @@
+#pragma once
+#include <chrono>
+#include <coroutine>
+#include <cstdlib>
+#include <deque>
+#include <queue>
+#include <utility>
+#include <vector>
+
+
+
+using SteadyClock = std::chrono::steady_clock;
+using TimePoint = SteadyClock::time_point;
+
+class Scheduler;
+
+// Coroutine returning a value of type T, started when it is awaited or spawned
+// on a Scheduler. Awaiting a task resumes the caller once the task has finished.
+template <typename T>
+class Task
+{
+public:
+    struct promise_type;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_type handle) noexcept {
+            auto continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct PromiseBase {
+        std::coroutine_handle<> continuation;
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() { std::abort(); }
+    };
+
+    struct promise_type : PromiseBase {
+        T value{};
+        Task get_return_object() { return Task(handle_type::from_promise(*this)); }
+        void return_value(T v) { value = std::move(v); }
+    };
+
+    Task() = default;
+    explicit Task(handle_type handle) : handle(handle) {}
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { if (handle) handle.destroy(); }
+
+    bool done() const { return !handle || handle.done(); }
+    T result() { return handle.promise().value; }
+
+    bool await_ready() { return done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    T await_resume() { return handle.promise().value; }
+
+private:
+    friend class Scheduler;
+    handle_type handle;
+};
+
+// Task without result
+template <>
+struct Task<void>::promise_type : Task<void>::PromiseBase {
+    Task get_return_object() { return Task(handle_type::from_promise(*this)); }
+    void return_void() {}
+};
+
+template <>
+inline void Task<void>::result() {}
+
+template <>
+inline void Task<void>::await_resume() {}
+
+
+
+// Single threaded event loop resuming coroutines when their deadline is reached
+// or when a file descriptor becomes ready. No thread and no stack per coroutine.
+class Scheduler
+{
+public:
+    Scheduler();
+    ~Scheduler();
+
+    // Start a coroutine on the next call to run (the scheduler owns it)
+    void spawn(Task<void> task);
+    // Run until every spawned coroutine has finished
+    void run();
+    // Scheduler running on the current thread, nullptr outside of run
+    static Scheduler* current();
+
+    // Used by the awaiters
+    void schedule(std::coroutine_handle<> handle);
+    void addTimer(TimePoint deadline, std::coroutine_handle<> handle);
+    void addWait(int fd, short events, TimePoint deadline, std::coroutine_handle<> handle, short* revents);
+
+private:
+    struct Timer {
+        TimePoint deadline;
+        unsigned long order;
+        std::coroutine_handle<> handle;
+        bool operator>(const Timer& other) const {
+            return deadline != other.deadline ? deadline > other.deadline : order > other.order;
+        }
+    };
+    struct Wait {
+        int fd;
+        short events;
+        TimePoint deadline;
+        std::coroutine_handle<> handle;
+        short* revents;
+    };
+
+    void poll(TimePoint now);
+
+    std::vector<Task<void>> tasks;
+    std::deque<std::coroutine_handle<>> ready;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    std::vector<Wait> waits;
+    unsigned long timerOrder;
+};
+
+// Awaiter suspending the coroutine until a point in time
+struct SleepAwaiter {
+    TimePoint deadline;
+    bool await_ready() { return SteadyClock::now() >= deadline; }
+    void await_suspend(std::coroutine_handle<> handle) { Scheduler::current()->addTimer(deadline, handle); }
+    void await_resume() {}
+};
+
+// Awaiter suspending the coroutine until a file descriptor is ready or the deadline is reached
+// Returns the poll events of the descriptor, 0 on timeout
+struct WaitFdAwaiter {
+    int fd;
+    short events;
+    TimePoint deadline;
+    short revents = 0;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        Scheduler::current()->addWait(fd, events, deadline, handle, &revents);
+    }
+    short await_resume() { return revents; }
+};
+
+SleepAwaiter sleep_until(TimePoint deadline);
+SleepAwaiter sleep_for(std::chrono::nanoseconds duration);
+WaitFdAwaiter wait_fd(int fd, short events, TimePoint deadline);
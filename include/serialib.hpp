@@ -35,6 +35,12 @@ This is a licence-free software, it can be used by anyone who try to build a bet
 #endif
     // Accessing to the serial port under Windows
     #include <windows.h>
+
+    /*! Scatter-gather element used by writeBytesv (same layout as the POSIX one) */
+    struct iovec {
+        void    *iov_base;  /**< start of the data */
+        size_t   iov_len;   /**< number of bytes */
+    };
 #endif
 
 // Include for Linux
@@ -50,8 +56,27 @@ This is a licence-free software, it can be used by anyone who try to build a bet
     #include <fcntl.h>
     #include <unistd.h>
     #include <sys/ioctl.h>
+    #include <poll.h>
+    #include <errno.h>
+    #include <sys/uio.h>
 #endif
 
+/*! Size of the internal receive buffer used by the read functions (Unix only) */
+#define SERIALIB_RX_BUFFER_SIZE 4096
+
+/*! Default time given to the driver to accept all the bytes of a write operation */
+#define SERIALIB_WRITE_TIMEOUT_MS 1000
+
+/*! Maximum number of iovec elements handed to the kernel in a single writev() call */
+#define SERIALIB_IOV_MAX 64
+
+/*! Output lines, to be combined in the parameters of serialib::setLines */
+#define SERIAL_LINE_DTR 0x01
+#define SERIAL_LINE_RTS 0x02
+
+#include <chrono>
+#include <stdint.h>
+
 /*! To avoid unused parameters */
 #define UNUSED(x) (void)(x)
 
@@ -86,6 +111,15 @@ enum SerialParity {
     SERIAL_PARITY_SPACE /**< space bit */
 };
 
+// Optional io_uring engine (serialuring.hpp)
+class serialUring;
+
+// Optional binary trace of the bytes sent and received (serialtracer.hpp)
+class serialTracer;
+
+// Coroutine type of the asynchronous operations (scheduler.hpp)
+template <typename T> class Task;
+
 /*!  \class     serialib
      \brief     This class is used for communication over a serial device.
 */
@@ -130,7 +164,7 @@ public:
 
 
     // Write a char
-    int     writeChar   (char);
+    int     writeChar   (char, const unsigned int timeOut_ms=SERIALIB_WRITE_TIMEOUT_MS);
 
     // Read a char (with timeout)
     int     readChar    (char *pByte,const unsigned int timeOut_ms=0);
@@ -143,7 +177,7 @@ public:
 
 
     // Write a string
-    int     writeString (const char *String);
+    int     writeString (const char *String, const unsigned int timeOut_ms=SERIALIB_WRITE_TIMEOUT_MS);
 
     // Read a string (with timeout)
     int     readString  (   char *receivedString,
@@ -158,7 +192,13 @@ public:
 
 
     // Write an array of bytes
-    int     writeBytes  (const void *Buffer, const unsigned int NbBytes);
+    int     writeBytes  (const void *Buffer, const unsigned int NbBytes, const unsigned int timeOut_ms=SERIALIB_WRITE_TIMEOUT_MS);
+
+    // Write several arrays of bytes in a single operation (scatter-gather)
+    int     writeBytesv (const struct iovec *Iov, const int IovCount, const unsigned int timeOut_ms=SERIALIB_WRITE_TIMEOUT_MS);
+
+    // Write an array of bytes with one driver call, without waiting for room in the driver buffer
+    int     tryWriteBytes (const void *Buffer, const unsigned int NbBytes);
 
     // Read an array of byte (with timeout)
     int     readBytes   (void *buffer,unsigned int maxNbBytes,const unsigned int timeOut_ms=0, unsigned int sleepDuration_us=100);
@@ -166,6 +206,19 @@ public:
 
 
 
+    // _______________________________________________________
+    // ::: Asynchronous operations (coroutines, scheduler.hpp) :::
+
+
+    // Write an array of bytes without blocking the thread
+    Task<int> writeBytesAsync (const void *Buffer, const unsigned int NbBytes, std::chrono::steady_clock::time_point deadline);
+
+    // Read an array of bytes without blocking the thread
+    Task<int> readBytesAsync  (void *buffer, unsigned int maxNbBytes, std::chrono::steady_clock::time_point deadline);
+
+
+
+
     // _________________________
     // ::: Special operation :::
 
@@ -176,6 +229,15 @@ public:
     // Return the number of bytes in the received buffer
     int     available();
 
+    // Use an io_uring engine for the read and write operations (Linux only)
+    int     setIoEngine(serialUring *engine);
+
+    // Return the file descriptor of the device (-1 on Windows or if closed)
+    int     getFileDescriptor();
+
+    // Record the bytes sent and received in a trace log
+    void    setTracer(serialTracer *tracer, uint16_t portId);
+
 
 
 
@@ -193,6 +255,9 @@ public:
     bool    setRTS();
     bool    clearRTS();
 
+    // Set DTR and RTS in a single operation
+    bool    setLines(int Lines, int Mask=SERIAL_LINE_DTR | SERIAL_LINE_RTS);
+
     // Get RI status (Ring Indicator, pin 9)
     bool    isRI();
 
@@ -219,6 +284,18 @@ private:
     // Current DTR and RTS state (can't be read on WIndows)
     bool            currentStateRTS;
     bool            currentStateDTR;
+#if defined (__linux__) || defined(__APPLE__)
+    // Modem control bits written by TIOCMSET, read when the device is opened
+    int             modemControl;
+#endif
+
+    // Trace log (NULL if tracing is disabled) and id of the port in the log
+    serialTracer    *tracer;
+    uint16_t        tracePort;
+
+    // Record the bytes sent and received
+    void            traceTx(const void *Buffer,size_t NbBytes);
+    void            traceRx(const void *Buffer,size_t NbBytes);
 
 
 
@@ -232,6 +309,23 @@ private:
 #endif
 #if defined (__linux__) || defined(__APPLE__)
     int             fd;
+
+    // I/O engine used instead of read/write/poll, NULL for the classic path
+    serialUring     *ioEngine;
+
+    // Read a string from the internal buffer (timeOut_ms < 0 means no timeout)
+    int             readStringBuffered  (char *String,char FinalChar,unsigned int MaxNbBytes,long int timeOut_ms);
+
+    // Pull all the pending bytes of the device into the internal buffer
+    int             fillRxBuffer        (int timeOut_ms);
+
+    // Copy bytes already buffered, return the number of bytes copied
+    unsigned int    drainRxBuffer       (void *Buffer,unsigned int MaxNbBytes);
+
+    // Internal receive buffer, valid data is in [rxHead, rxTail)
+    char            rxBuffer[SERIALIB_RX_BUFFER_SIZE];
+    unsigned int    rxHead;
+    unsigned int    rxTail;
 #endif
 
 };
@@ -0,0 +1,162 @@
+/*!
+\file    serialmodem.hpp
+\brief   Header file of the classes serialModemMonitor and serialLineSequence.
+         serialModemMonitor watches the modem input lines (CTS, DSR, DCD, RI) of a serial port
+         and reports their edges as events, serialLineSequence plays timed changes of the output
+         lines (DTR, RTS).
+
+A helper thread sleeps in the driver (TIOCMIWAIT) until one of the watched lines changes, so the
+monitor uses no CPU while the lines are idle and wakes up within microseconds of an edge. The
+interrupt counters of the driver (TIOCGICOUNT) tell how many edges happened since the previous
+event, so edges too close together to be seen one by one are counted instead of lost.
+Linux only: the driver of the port must support TIOCMIWAIT (USB serial adapters and 8250 UARTs
+do, pseudo terminals do not).
+
+A line sequence is a list of steps at offsets from its start. Each step is played at an absolute
+deadline, so the error of one step does not shift the next ones, and the steps at the same
+offset change both lines in a single serialib::setLines.
+*/
+
+
+#ifndef SERIALMODEM_H
+#define SERIALMODEM_H
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "mpscqueue.hpp"
+
+/*! Modem input lines, to be combined in the Lines parameter of serialModemMonitor::start */
+#define SERIAL_MODEM_CTS    0x01    /**< Clear To Send */
+#define SERIAL_MODEM_DSR    0x02    /**< Data Set Ready */
+#define SERIAL_MODEM_DCD    0x04    /**< Data Carrier Detect */
+#define SERIAL_MODEM_RI     0x08    /**< Ring Indicator, the drivers only count its trailing edges */
+
+/*! Number of events which can wait for serialModemMonitor::nextEvent */
+#define SERIALMODEM_QUEUE_SIZE 256
+
+/*! Signal sent to the helper thread to interrupt TIOCMIWAIT when the monitor stops. A handler
+    installed by the application must not use SA_RESTART. */
+#ifndef SERIALMODEM_WAKE_SIGNAL
+#define SERIALMODEM_WAKE_SIGNAL SIGURG
+#endif
+
+/*!  \struct    serialModemEvent
+     \brief     Edges of one modem line
+*/
+struct serialModemEvent {
+    uint64_t    timestamp_ns;   /**< monotonic time (steady clock) at which the edge was seen */
+    uint32_t    edges;          /**< edges counted by the driver since the previous event of the line, 1 unless edges were missed */
+    uint8_t     line;           /**< SERIAL_MODEM_CTS, SERIAL_MODEM_DSR, SERIAL_MODEM_DCD or SERIAL_MODEM_RI */
+    uint8_t     level;          /**< level of the line after the edges, 1 if asserted */
+};
+
+/*! Receives the events on the helper thread, see serialModemMonitor::start */
+typedef std::function<void(const serialModemEvent&)> serialModemCallback;
+
+class serialib;
+
+/*!  \class     serialModemMonitor
+     \brief     Reports the edges of the modem input lines of a serial port
+*/
+class serialModemMonitor
+{
+public:
+
+    // Constructor of the class
+    serialModemMonitor  ();
+
+    // Destructor
+    ~serialModemMonitor ();
+
+    // Start watching the lines of an open port
+    int             start           (serialib *Port,int Lines,serialModemCallback Callback=nullptr);
+
+    // Stop the helper thread
+    void            stop            ();
+
+    // Check if the helper thread is running
+    bool            isRunning       ();
+
+    // Return a file descriptor readable when events are queued (Linux only)
+    int             getEventFd      ();
+
+    // Read the next queued event
+    int             nextEvent       (serialModemEvent *Event);
+
+    // Return the number of edges reported by the driver but not seen one by one
+    uint64_t        getMissedEdges  ();
+
+    // Return the number of events dropped because the queue was full
+    uint64_t        getDroppedEvents();
+
+private:
+    void            run             ();
+    void            deliver         (const serialModemEvent &Event);
+
+    int                     fd;
+    int                     eventFd;
+    int                     lines;
+    serialModemCallback     callback;
+    std::thread             thread;
+    std::atomic<bool>       running;
+    std::atomic<bool>       stopping;
+    std::atomic<uint64_t>   missedEdges;
+    std::atomic<uint64_t>   droppedEvents;
+    MpscQueue<serialModemEvent,SERIALMODEM_QUEUE_SIZE> events;
+};
+
+
+
+/*!  \struct    serialLineStep
+     \brief     Change of the output lines at a given time of a sequence
+*/
+struct serialLineStep {
+    uint64_t    offset_ns;      /**< time of the change from the start of the sequence */
+    uint8_t     lines;          /**< new state of the lines in mask, SERIAL_LINE_DTR and SERIAL_LINE_RTS */
+    uint8_t     mask;           /**< lines changed by the step */
+};
+
+/*!  \class     serialLineSequence
+     \brief     Timed pulse trains on the DTR and RTS lines of a serial port
+*/
+class serialLineSequence
+{
+public:
+
+    // Constructor of the class
+    serialLineSequence  ();
+
+    // Remove every step
+    void            clear           ();
+
+    // Change lines at a given time
+    void            set             (uint64_t Offset_us,int Lines,int Mask);
+
+    // Add a pulse on one line
+    void            pulse           (int Line,uint64_t Start_us,uint64_t Width_us,bool Active=true);
+
+    // Add a train of pulses on one line
+    void            train           (int Line,uint64_t Start_us,uint64_t Width_us,uint64_t Period_us,unsigned int Count,bool Active=true);
+
+    // Play the sequence, blocking the calling thread until the last step
+    int             play            (serialib *Port);
+    int             play            (serialib *Port,std::chrono::steady_clock::time_point Start);
+
+    // Spin before each step for a wake-up closer to its deadline
+    void            setSpin         (unsigned int Spin_us);
+
+    // Return the largest delay between a deadline and its line change during the last play
+    uint64_t        getMaxLateness  ();
+
+private:
+    std::vector<serialLineStep> steps;
+    bool                        sorted;
+    unsigned int                spinUs;
+    uint64_t                    maxLateness;
+};
+
+#endif // SERIALMODEM_H
@@ -0,0 +1,136 @@
+/*!
+\file    serialtracer.hpp
+\brief   Header file of the class serialTracer. This class records the bytes sent and received
+         by serial ports in a memory-mapped binary log.
+
+The log is a preallocated file made of a header followed by a ring of fixed size records.
+Appending a record takes one atomic increment, one clock read and a 32 bytes copy: it never
+blocks, never allocates and never calls the kernel, so tracing can be left enabled.
+When the ring is full the oldest records are overwritten.
+*/
+
+
+#ifndef SERIALTRACER_H
+#define SERIALTRACER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/*! Magic number at the start of a trace file */
+#define SERIALTRACE_MAGIC "USBRTRC1"
+
+/*! Number of data bytes carried by one record, longer byte runs use several records */
+#define SERIALTRACE_RECORD_DATA 12
+
+/**
+ * direction of the bytes of a record
+ */
+enum SerialTraceDirection {
+    SERIAL_TRACE_TX, /**< bytes written to the device */
+    SERIAL_TRACE_RX, /**< bytes read from the device */
+};
+
+/*!  \struct    serialTraceHeader
+     \brief     Header of a trace file (64 bytes)
+*/
+struct serialTraceHeader {
+    char                    magic[8];       /**< SERIALTRACE_MAGIC */
+    uint32_t                recordSize;     /**< size of a record, sizeof(serialTraceRecord) */
+    uint32_t                recordCount;    /**< number of records in the ring (power of two) */
+    std::atomic<uint64_t>   nextSequence;   /**< sequence number of the next record */
+    uint8_t                 reserved[40];
+};
+
+/*!  \struct    serialTraceRecord
+     \brief     One run of bytes (32 bytes)
+*/
+struct serialTraceRecord {
+    std::atomic<uint64_t>   sequence;       /**< sequence number + 1, 0 while the record is written */
+    uint64_t                timestamp_ns;   /**< monotonic time (steady clock) */
+    uint16_t                port;           /**< port id given to serialib::setTracer */
+    uint8_t                 direction;      /**< SerialTraceDirection */
+    uint8_t                 length;         /**< number of valid bytes in data */
+    char                    data[SERIALTRACE_RECORD_DATA];
+};
+
+
+/*!  \struct    serialTraceEvent
+     \brief     Copy of a record read back from a trace file
+*/
+struct serialTraceEvent {
+    uint64_t                sequence;       /**< sequence number of the record */
+    uint64_t                timestamp_ns;   /**< monotonic time (steady clock) */
+    uint16_t                port;           /**< port id */
+    uint8_t                 direction;      /**< SerialTraceDirection */
+    uint8_t                 length;         /**< number of valid bytes in data */
+    char                    data[SERIALTRACE_RECORD_DATA];
+};
+
+
+/*!  \class     serialTracer
+     \brief     Memory-mapped binary log of the bytes sent and received on serial ports
+*/
+class serialTracer
+{
+public:
+
+    // Constructor of the class
+    serialTracer    ();
+
+    // Destructor
+    ~serialTracer   ();
+
+    // Create the log file
+    int             open            (const char *Path,unsigned int recordCount=1<<20);
+
+    // Unmap and close the log file
+    void            close           ();
+
+    // Check if the log is open
+    bool            isOpen          ();
+
+    // Append a run of bytes
+    void            record          (uint16_t port,SerialTraceDirection direction,const void *Buffer,unsigned int NbBytes);
+
+private:
+    serialTraceHeader   *header;
+    serialTraceRecord   *records;
+    uint64_t            mask;
+    size_t              mapSize;
+};
+
+
+
+/*!  \class     serialTraceReader
+     \brief     Read back the records of a trace file, oldest first
+*/
+class serialTraceReader
+{
+public:
+
+    // Constructor of the class
+    serialTraceReader   ();
+
+    // Destructor
+    ~serialTraceReader  ();
+
+    // Open a trace file
+    int             open            (const char *Path);
+
+    // Close the trace file
+    void            close           ();
+
+    // Read the next record
+    int             next            (serialTraceEvent *event);
+
+private:
+    serialTraceHeader   *header;
+    serialTraceRecord   *records;
+    uint64_t            mask;
+    size_t              mapSize;
+    uint64_t            sequence;
+    uint64_t            lastSequence;
+};
+
+#endif // SERIALTRACER_H
@@ -0,0 +1,123 @@
+/*!
+\file    serialuring.hpp
+\brief   Header file of the class serialUring. This class is an optional io_uring based I/O engine
+         for serialib (Linux only).
+
+The engine submits reads and writes with a linked timeout and reaps the completions in batches,
+so that several serial ports can be served with a single system call. On systems without
+io_uring, open() fails and serialib keeps using the classic read/write/poll path.
+*/
+
+
+#ifndef SERIALURING_H
+#define SERIALURING_H
+
+#include <stdint.h>
+#include <stddef.h>
+// struct iovec
+#include <serialib.hpp>
+
+/*! Tags with this bit set are reserved by the engine */
+#define SERIALURING_TAG_RESERVED (1ULL << 63)
+
+
+/*!  \struct    serialCompletion
+     \brief     Result of a request submitted to a serialUring engine
+*/
+struct serialCompletion {
+    uint64_t    tag;        /**< value given when the request was queued */
+    int         result;     /**< bytes transferred, -ETIME if the timeout was reached, negative errno on error */
+};
+
+
+/*!  \class     serialUring
+     \brief     io_uring based I/O engine shared by one or several serial ports
+*/
+class serialUring
+{
+public:
+
+    // Constructor of the class
+    serialUring     ();
+
+    // Destructor
+    ~serialUring    ();
+
+    // Create the ring
+    int             open            (unsigned int entries=128);
+
+    // Release the ring
+    void            close           ();
+
+    // Check if the ring can be used
+    bool            isAvailable     ();
+
+    // Queue a write request (not submitted until wait is called)
+    int             queueWrite      (int fd,const struct iovec *Iov,int IovCount,unsigned int timeOut_ms,uint64_t tag);
+
+    // Queue a read request (not submitted until wait is called)
+    int             queueRead       (int fd,void *Buffer,unsigned int MaxNbBytes,unsigned int timeOut_ms,uint64_t tag);
+
+    // Submit the queued requests and collect the completed ones
+    int             wait            (serialCompletion *completions,unsigned int maxNb,unsigned int minNb);
+
+    // Submit the queued requests and wait for the completion of a given request
+    int             waitFor         (uint64_t tag);
+
+    // Number of requests submitted or queued but not reaped yet
+    unsigned int    pending         ();
+
+    // Number of io_uring_enter system calls performed since open
+    unsigned long   getEnterCount   ();
+
+private:
+    // Check if the submission queue has room for a request
+    bool            hasRoom         (unsigned int nbEntries);
+
+    // Take the next submission entry
+    void*           nextSqe         ();
+
+    // Move the completion queue entries to the completion stash
+    void            reap            ();
+
+    // Call io_uring_enter
+    int             enter           (unsigned int toSubmit,unsigned int minComplete);
+
+    // Append a linked timeout to the last submission entry
+    void*           linkTimeout     (void *sqe,unsigned int timeOut_ms);
+
+    int             ringFd;
+    unsigned int    entries;
+
+    // Submission ring
+    void            *sqRing;
+    size_t          sqRingSize;
+    unsigned int    *sqHead;
+    unsigned int    *sqTail;
+    unsigned int    *sqMask;
+    unsigned int    *sqArray;
+    void            *sqes;
+    size_t          sqesSize;
+    unsigned int    sqLocalTail;
+    unsigned int    sqPending;
+
+    // Completion ring
+    void            *cqRing;
+    size_t          cqRingSize;
+    unsigned int    *cqHead;
+    unsigned int    *cqTail;
+    unsigned int    *cqMask;
+    void            *cqes;
+
+    // Timeouts referenced by the linked timeout entries, one per submission slot
+    void            *timeouts;
+
+    // Completions reaped but not yet returned to the caller
+    serialCompletion *stash;
+    unsigned int    stashCount;
+
+    unsigned int    inFlight;
+    unsigned long   enterCount;
+};
+
+#endif // SERIALURING_H
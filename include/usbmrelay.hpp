@@ -1,15 +1,62 @@
 
 #pragma once
 #include <serialib.hpp>
+#include <scheduler.hpp>
+#include <deadline.hpp>
+#include <realtime.hpp>
+#include <serialtracer.hpp>
+#include <relaystate.hpp>
+#include <relaymirror.hpp>
+#include <relayframe.hpp>
+#include <mpscqueue.hpp>
+#include <array>
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <semaphore>
+#include <thread>
 #include <string>
 #include <vector>
 #include <bitset>
+#include <functional>
 
 
 
 using std::string;
 
+// Largest board supported by the LCUS protocol frames sent by this library
+#define USBMRELAY_MAX_RELAYS 64
+
+// Number of commands which can wait for the writer thread, see submitState
+#define USBMRELAY_QUEUE_SIZE 256
+
+// First wait before reopening a lost port, doubled after each failed attempt
+#define USBMRELAY_RECONNECT_MIN_MS 10
+
+// Longest wait for the answer to the status query of queryState
+#define USBMRELAY_QUERY_TIMEOUT_MS 100
+
+// Status queries in a row without answer after which the automatic refresh stops
+#define USBMRELAY_REFRESH_FAILURES 5
+
+// Reads the state the relays of a board are really in, for calibrateDelay: from the board
+// firmware, from a loopback wiring or from a simulator. Returns 1 on success.
+typedef std::function<int(uint64_t& state)> RelayReadback;
+
+// Statistics of the automatic reconnection, see setAutoReconnect
+struct RelayReconnectStats {
+    uint64_t reconnects = 0; // Outages recovered
+    uint64_t attempts = 0; // Attempts to reopen the port
+    double lastoutagems = 0; // Last outage, from the failed write to the relays back in state
+    double lastrestorems = 0; // Last outage, from the device back to the relays back in state
+};
+
+
+// Frame plan of the all-off sequence written by a watchdog, see getFailSafePlan
+struct RelayFailSafePlan {
+    int frames = 0; // Frames of the sequence: one per relay, or a single one without delay
+    int delayms = 0; // Delay after each frame, in milliseconds
+};
 
 
 
@@ -19,12 +66,30 @@ class Usbmrelay
 public:
     
     Usbmrelay(const string& port,int relaynumber = 8);
+    ~Usbmrelay();
     int openCom();  
     int closeCom();
     int  initBoard();
     int setState(int*);
     int setState(int);
+    int setState(const std::bitset<USBMRELAY_MAX_RELAYS>&);
+    int setStateMask(uint64_t state);
+    int setStateUrgent(uint64_t state);
+    int emergencyOff();
+    int startWriter();
+    int setWriterRealtime(const RealtimeConfig& config);
+    RealtimeStatus getWriterRealtime();
+    void stopWriter();
+    int submitState(uint64_t state, uint64_t relays = ~0ULL);
+    uint64_t getWriterErrors();
+    int setAutoReconnect(bool enable, unsigned int maxbackoffms = 2000);
+    bool isConnected();
+    RelayReconnectStats getReconnectStats();
+    Task<int> setStateAsync(int);
+    Task<int> setStateMaskAsync(uint64_t state, uint64_t relays = ~0ULL);
+    Task<int> initBoardAsync();
     std::vector<int> getState();
+    uint64_t getStateMask();
     std::vector<char> gettx();
     std::vector<char> getrx();
     int getSpeed();
@@ -32,24 +97,125 @@ public:
     int getRelayNumber();
     int setPort(const std::string &port);
     int setDelay(int delay);
+    int getDelay();
+    int queryState(uint64_t& state);
+    int setQueryTtl(unsigned int ttlms);
+    int setStateQuery(const RelayReadback& query);
+    int setAutoRefresh(unsigned int periodms);
+    int calibrateDelay(const RelayReadback& readback, int marginpercent = 25, int startms = 20, int settlems = 50);
+    RelayFailSafePlan getFailSafePlan();
+    int writeFailSafeFrame(int index, const RelayFailSafePlan& plan);
+    int setTracer(serialTracer* tracer, int portid);
+    int setStateFile(const std::string &path);
+    int setMirror(RelayStateMirror* mirror, int slot);
+    bool isInitialized();
+    int setRateLimit(int relay, unsigned int intervalms, unsigned int burst = 1);
+    int flushPending();
+    long pendingDelay();
+    uint64_t getPendingMask();
+    RelayFrameStats getFrameStats();
     
 private:
 
-    int send(std::vector<int> data,unsigned long milliseconds);
+    int send(const char* data,unsigned int nbyte,unsigned long milliseconds);
+    uint64_t allRelays();
+    int encodeFrames(uint64_t state, uint64_t relays, char* buffer);
+    int writeFrames(uint64_t state, uint64_t relays, bool changesonly = false, bool urgent = false);
+    int writeFramesLocked(std::unique_lock<PriorityMutex>& lock, uint64_t generation, uint64_t state,
+                          uint64_t relays, bool changesonly, bool urgent, int framedelay);
+    int holdForReconnect(uint64_t state, uint64_t relays);
+    bool portLost();
+    Task<int> writeFramesAsync(uint64_t state, uint64_t relays, bool changesonly = false);
+    void reconnectLoop();
+    void stopReconnect();
+    uint64_t admit(uint64_t& state, uint64_t& relays);
+    void charge(uint64_t relays);
     int recieve(int nbyte);
     void bufferrxAdd(char elt);
     void buffertxAdd(char elt);
+    void saveState();
+    void publishMirror();
+    int refreshLocked(std::unique_lock<PriorityMutex>& lock, uint64_t& state);
+    int readStatusLocked(std::unique_lock<PriorityMutex>& lock, uint64_t& state);
+    void refreshLoop(unsigned int periodms);
+    void stopRefresh();
     int baudrate;
     int relaynumber;
-    int delay;
+    std::atomic<int> delay{20}; // Read once per command, see setDelay
     std::string device;
-    std::vector<int> boardstate = std::vector<int>(8); 
+    std::atomic<uint64_t> boardstate{0}; // bit i for relay i+1, written under the frame lock
     std::vector<char> buffertx =  std::vector<char>(8);
     std::vector<char> bufferrx =  std::vector<char>(8);
+    RelayFrameParser responses; // Frames received from the board
     std::unique_ptr<serialib> boardinterface;
+    serialTracer* tracer = nullptr;
+    int traceport = 0;
+    std::string statefile;
+    RelayStateStore statestore;
+    std::atomic<bool> initialized{false};
+    std::atomic<RelayStateMirror*> mirror{nullptr}; // Published by saveState and the fail-safe, see publishMirror
+    std::atomic<int> mirrorslot{0};
+    std::atomic<bool> mirrorbusy{false}; // A thread is publishing to the mirror
+    std::atomic<uint64_t> mirrorrequests{0}; // Publishes asked for, see publishMirror
+    uint64_t devicestamp = 0;
+    struct RateLimit { // Token bucket of one relay, as a theoretical arrival time (GCRA)
+        uint64_t interval_ns = 0; // Time to earn one switch, 0 if the relay is not limited
+        uint64_t tolerance_ns = 0; // (burst - 1) * interval_ns
+        uint64_t tat_ns = 0; // Time at which the bucket is full again
+    };
+    std::array<RateLimit, USBMRELAY_MAX_RELAYS> ratelimits;
+    uint64_t limitedrelays = 0; // Relays with a rate limit
+    uint64_t pendingrelays = 0; // Relays with a change held back by their rate limit
+    uint64_t pendingstate = 0; // Last state requested for the pending relays
+    PriorityMutex framelock; // Held while a frame is written and during the delay after it, see setWriterRealtime
+    std::atomic<uint64_t> urgentcount{0}; // Number of urgent commands issued
+    char failsafe[4 * USBMRELAY_MAX_RELAYS]; // All-off frames, encoded by the constructor
+    std::atomic<bool> failsafesent{false}; // Set when a watchdog switched the relays off
+    std::atomic<bool> portready{false}; // The port is open, for the fail-safe frames
+    std::atomic<int> portusers{0}; // Fail-safe frames being written, see waitPortIdle
+    bool syncFailSafe();
+    void waitPortIdle();
+    void closePort();
+    struct Command { // Command submitted to the writer thread
+        uint64_t state;
+        uint64_t relays;
+    };
+    void writerLoop();
+    bool drainCommands();
+    MpscQueue<Command, USBMRELAY_QUEUE_SIZE> commands;
+    std::counting_semaphore<> submitted{0}; // Released after each push, the writer thread waits on it
+    std::atomic<bool> writerrunning{false};
+    std::atomic<int> submitters{0}; // Calls of submitState in progress
+    std::atomic<uint64_t> writererrors{0};
+    std::thread writer;
+    bool writerrealtime = false;
+    RealtimeConfig writerconfig;
+    RealtimeStatus writerstatus; // Written by the writer thread before it takes commands
+    bool autoreconnect = false;
+    unsigned int maxbackoffms = 2000;
+    std::atomic<bool> connected{true}; // Cleared during an outage: only the reconnect thread uses the port
+    int writeerror = 0; // errno (GetLastError on Windows) of the last failed write, under the frame lock
+    bool reconnecting = false; // A reconnect thread is running
+    std::atomic<bool> reconnectstop{false};
+    uint64_t reconnectstate = 0; // State to restore once reconnected, under the frame lock
+    SteadyClock::time_point outagestart;
+    RelayReconnectStats reconnectstats;
+    std::thread reconnector;
+    RelayReadback statequery; // Status query of the firmware, empty for the 0xFF query
+    std::mutex querylock; // Held by a status query, taken before the frame lock
+    bool querybusy = false; // A status query reads the port without the frame lock
+    uint64_t framecount = 0; // Writes to the board, under the frame lock
+    SteadyClock::time_point nextframe{}; // End of the delay after the last write, under the frame lock
+    unsigned int queryttlms = 0;
+    bool queryvalid = false; // querystate is the last readback and no frame was written since
+    uint64_t querystate = 0;
+    SteadyClock::time_point querytime;
+    std::atomic<bool> refreshstop{false};
+    std::thread refresher;
     
 };
 
 std::vector<std::string> scanBoard();
 std::bitset<8> charToBitset(char);
+uint64_t deviceStamp(const std::string &device);
 void os_sleep(unsigned long);
\ No newline at end of file
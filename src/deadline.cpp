@@ -0,0 +1,65 @@
+#include <deadline.hpp>
+#include <thread>
+
+#if defined (__linux__)
+#include <cerrno>
+#include <time.h>
+#endif
+
+// Blocks the calling thread until an absolute deadline, see deadline.hpp
+// Parameters: deadline - the time to wake up at, steady clock
+//             spinus - the last microseconds before the deadline are spent spinning on the clock
+// Returns: the lateness in nanoseconds, 0 if the deadline was met
+int64_t sleepUntil(TimePoint deadline, unsigned int spinus) {
+    TimePoint wake = deadline - std::chrono::microseconds(spinus);
+    if (SteadyClock::now() < wake) {
+#if defined (__linux__)
+        // The steady clock of libstdc++ and libc++ is CLOCK_MONOTONIC: sleep until the time itself
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wake.time_since_epoch()).count();
+        struct timespec when;
+        when.tv_sec = ns / 1000000000;
+        when.tv_nsec = ns % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, nullptr) == EINTR) {
+        }
+#else
+        std::this_thread::sleep_until(wake);
+#endif
+    }
+    TimePoint now = SteadyClock::now();
+    while (now < deadline)
+        now = SteadyClock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now - deadline).count();
+}
+
+// Constructor, the first deadline is one period after start
+// Parameters: period - the time between two deadlines
+//             start - the origin of the deadlines
+PeriodicDeadline::PeriodicDeadline(std::chrono::nanoseconds period, TimePoint start) {
+    this->period = period;
+    this->deadline = start + period;
+}
+
+// Sleeps until the next deadline, skipping the deadlines missed by more than a period
+// Parameters: spinus - see sleepUntil
+// Returns: the lateness in nanoseconds
+int64_t PeriodicDeadline::wait(unsigned int spinus) {
+    TimePoint now = SteadyClock::now();
+    if (now - deadline > period) {
+        uint64_t behind = (now - deadline) / period;
+        deadline += behind * period;
+        missed += behind;
+    }
+    int64_t late = sleepUntil(deadline, spinus);
+    deadline += period;
+    return late;
+}
+
+// Returns: the deadline of the next call to wait
+TimePoint PeriodicDeadline::next() {
+    return deadline;
+}
+
+// Returns: the number of deadlines skipped since the start
+uint64_t PeriodicDeadline::getMissed() {
+    return missed;
+}
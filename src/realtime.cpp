@@ -0,0 +1,131 @@
+#include <realtime.hpp>
+
+#if defined (__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined (__linux__)
+// Touches the stack of the calling thread down to a depth, the pages stay resident once
+// the memory is locked
+// Parameters: size - the depth in bytes
+static void __attribute__((noinline)) prefaultStack(size_t size) {
+    volatile unsigned char* stack = (volatile unsigned char*)__builtin_alloca(size);
+    for (size_t i = 0; i < size; i += 4096)
+        stack[i] = 0;
+}
+#endif
+
+// Switches the calling thread to real-time execution, see realtime.hpp
+// Parameters: config - the settings
+//             status - receives the settings applied, may be nullptr
+// Returns: 1 if every requested setting is applied, -1 otherwise
+int enterRealtime(const RealtimeConfig& config, RealtimeStatus* status) {
+    RealtimeStatus applied;
+    bool ok = true;
+#if defined (__linux__)
+    // Lock first, so that the stack touched below is kept
+    if (config.lockmemory) {
+        applied.memory = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+        ok = ok && applied.memory;
+    }
+    if (config.prefaultstack > 0)
+        prefaultStack(config.prefaultstack);
+    if (config.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(config.cpu, &cpus);
+        applied.affinity = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+        ok = ok && applied.affinity;
+    }
+    if (config.priority > 0) {
+        struct sched_param param = {};
+        param.sched_priority = config.priority;
+        applied.scheduler = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+        ok = ok && applied.scheduler;
+    }
+#else
+    ok = config.priority <= 0 && config.cpu < 0 && !config.lockmemory;
+#endif
+    if (status != nullptr)
+        *status = applied;
+    return ok ? 1 : -1;
+}
+
+// Returns the calling thread to the normal scheduler on any CPU
+void leaveRealtime() {
+#if defined (__linux__)
+    struct sched_param param = {};
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+    for (long cpu = 0; cpu < count && cpu < CPU_SETSIZE; cpu++)
+        CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+}
+
+// Touches every page of a buffer
+// Parameters: buffer - the buffer
+//             size - its size in bytes
+void prefault(void* buffer, size_t size) {
+    volatile unsigned char* bytes = (volatile unsigned char*)buffer;
+    long page = 4096;
+#if defined (__linux__)
+    page = sysconf(_SC_PAGESIZE);
+#endif
+    for (size_t i = 0; i < size; i += page)
+        bytes[i] = bytes[i];
+    if (size > 0)
+        bytes[size - 1] = bytes[size - 1];
+}
+
+// Constructor, the mutex is unlocked
+PriorityMutex::PriorityMutex() {
+#if defined (__linux__)
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    if (pthread_mutexattr_setprotocol(&attributes, PTHREAD_PRIO_INHERIT) != 0 ||
+        pthread_mutex_init(&mutex, &attributes) != 0)
+        pthread_mutex_init(&mutex, nullptr); // No priority inheritance on this system
+    pthread_mutexattr_destroy(&attributes);
+#endif
+}
+
+// Destructor, the mutex must be unlocked
+PriorityMutex::~PriorityMutex() {
+#if defined (__linux__)
+    pthread_mutex_destroy(&mutex);
+#endif
+}
+
+// Locks the mutex, waiting for it if another thread holds it
+void PriorityMutex::lock() {
+#if defined (__linux__)
+    pthread_mutex_lock(&mutex);
+#else
+    mutex.lock();
+#endif
+}
+
+// Locks the mutex if no other thread holds it
+// Returns: true if locked
+bool PriorityMutex::try_lock() {
+#if defined (__linux__)
+    return pthread_mutex_trylock(&mutex) == 0;
+#else
+    return mutex.try_lock();
+#endif
+}
+
+// Unlocks the mutex
+void PriorityMutex::unlock() {
+#if defined (__linux__)
+    pthread_mutex_unlock(&mutex);
+#else
+    mutex.unlock();
+#endif
+}
@@ -0,0 +1,148 @@
+#include <relaybank.hpp>
+#include <algorithm>
+
+
+
+// Constructor, the bank has no channel
+RelayBank::RelayBank() {
+}
+
+// Appends the relays of a board to the bank, the board must outlive the bank
+// Parameters: board - an open board
+// Returns: the channel of its relay 1, -1 if the bank would exceed RELAYBANK_MAX_CHANNELS
+int RelayBank::addBoard(Usbmrelay* board) {
+    if (board == nullptr || channels + board->getRelayNumber() > RELAYBANK_MAX_CHANNELS)
+        return -1;
+    boards.push_back(Board{board, channels, board->getRelayNumber()});
+    channels += board->getRelayNumber();
+    return boards.back().first;
+}
+
+// Appends the relays of every board of a fleet, in the order of the fleet
+// Parameters: fleet - the fleet, it must outlive the bank
+// Returns: the channel of the relay 1 of its first board, -1 if the bank would be too large
+int RelayBank::addFleet(RelayFleet& fleet) {
+    int first = channels;
+    int count = 0;
+    for (int i = 0; i < fleet.size(); i++)
+        count += fleet.board(i)->getRelayNumber();
+    if (channels + count > RELAYBANK_MAX_CHANNELS)
+        return -1;
+    for (int i = 0; i < fleet.size(); i++)
+        addBoard(fleet.board(i));
+    return first;
+}
+
+// Returns: the number of channels of the bank
+int RelayBank::size() {
+    return channels;
+}
+
+// Returns: the number of boards of the bank
+int RelayBank::getBoardCount() {
+    return boards.size();
+}
+
+// Finds the relay behind a channel
+// Parameters: channel - the channel, from 0
+//             board - receives the index of the board in the bank
+//             relay - receives the relay on the board, from 1
+// Returns: 1 if successful, -1 if there is no such channel
+int RelayBank::locate(int channel, int& board, int& relay) {
+    if (channel < 0 || channel >= channels)
+        return -1;
+    auto it = std::upper_bound(boards.begin(), boards.end(), channel,
+                               [](int c, const Board& b) { return c < b.first; });
+    board = it - boards.begin() - 1;
+    relay = channel - boards[board].first + 1;
+    return 1;
+}
+
+// Sets the state of every channel, only the relays which change get a frame
+// Parameters: state - the state of the channels, bit c for channel c
+// Returns: 1 if successful, otherwise the error of a board, see Usbmrelay::setStateMask
+int RelayBank::setStateMask(const RelayBankMask& state) {
+    return setStateMask(state, RelayBankMask().set());
+}
+
+// Sets the state of some channels, the others keep their state
+// Parameters: state - the state of the channels, bit c for channel c
+//             channels - the channels to set, bit c for channel c
+// Returns: 1 if successful, otherwise the error of a board, see Usbmrelay::setStateMask
+int RelayBank::setStateMask(const RelayBankMask& state, const RelayBankMask& channels) {
+    Scheduler scheduler;
+    std::vector<int> statuses(boards.size(), 1);
+    for (size_t i = 0; i < boards.size(); i++) {
+        uint64_t relays = slice(channels, i);
+        uint64_t target = slice(state, i);
+        if (((target ^ boards[i].board->getStateMask()) & relays) == 0 && boards[i].board->isInitialized())
+            continue; // Nothing changes on this board
+        scheduler.spawn(writeBoard(i, target, relays, statuses[i]));
+    }
+    scheduler.run();
+    for (int status : statuses)
+        if (status != 1)
+            return status;
+    return 1;
+}
+
+// Switches channels to the opposite state
+// Parameters: channels - the channels to switch, bit c for channel c
+// Returns: see setStateMask
+int RelayBank::toggle(const RelayBankMask& channels) {
+    return setStateMask(~getStateMask(), channels);
+}
+
+// Sets the state of one channel
+// Parameters: channel - the channel, from 0
+//             on - the new state
+// Returns: see setStateMask, -1 if there is no such channel
+int RelayBank::setChannel(int channel, bool on) {
+    if (channel < 0 || channel >= channels)
+        return -1;
+    RelayBankMask state, mask;
+    state.set(channel, on);
+    mask.set(channel);
+    return setStateMask(state, mask);
+}
+
+// Returns: the state of every channel, bit c for channel c
+RelayBankMask RelayBank::getStateMask() {
+    RelayBankMask state;
+    for (size_t i = boards.size(); i-- > 0;) {
+        state <<= boards[i].relaynumber;
+        state |= RelayBankMask(boards[i].board->getStateMask());
+    }
+    return state;
+}
+
+// Returns: the state of a channel, false if there is no such channel
+bool RelayBank::getChannel(int channel) {
+    int board, relay;
+    if (locate(channel, board, relay) != 1)
+        return false;
+    return (boards[board].board->getStateMask() >> (relay - 1)) & 1;
+}
+
+// Writes the delta of one board
+// Parameters: index - the index of the board
+//             state - the state of its relays, bit i for relay i+1
+//             relays - the relays to set
+//             status - receives the result
+Task<void> RelayBank::writeBoard(int index, uint64_t state, uint64_t relays, int& status) {
+    status = co_await boards[index].board->setStateMaskAsync(state, relays);
+}
+
+// Extracts the bits of one board from a mask of the bank
+// Parameters: mask - bit c for channel c
+//             index - the index of the board
+// Returns: bit i for relay i+1 of the board
+uint64_t RelayBank::slice(const RelayBankMask& mask, int index) {
+    const Board& board = boards[index];
+    RelayBankMask low = mask >> board.first;
+    if (board.relaynumber < 64)
+        low &= RelayBankMask((1ULL << board.relaynumber) - 1);
+    else
+        low &= RelayBankMask(~0ULL);
+    return low.to_ullong();
+}
@@ -0,0 +1,74 @@
+#include <relayfleet.hpp>
+
+
+
+// Constructor, the fleet is empty
+RelayFleet::RelayFleet() {
+}
+
+// Adds a board to the fleet, before bootstrap
+// Parameters: config - the port and the settings of the board
+// Returns: the index of the board in the fleet
+int RelayFleet::add(const RelayBoardConfig& config) {
+    configs.push_back(config);
+    boards.push_back(std::make_unique<Usbmrelay>(config.port, config.relaynumber));
+    return boards.size() - 1;
+}
+
+// Opens, configures and initializes every board of the fleet concurrently. A board whose
+// state file shows it is still initialized keeps its relays as they are.
+// Parameters: ready - called for each board as soon as it is ready or has failed, from the
+//                     calling thread
+// Returns: the number of boards ready
+int RelayFleet::bootstrap(const RelayReadyCallback& ready) {
+    Scheduler scheduler;
+    TimePoint start = SteadyClock::now();
+    int nready = 0;
+    for (size_t i = 0; i < boards.size(); i++)
+        scheduler.spawn(bootBoard(i, start, ready, nready));
+    scheduler.run();
+    return nready;
+}
+
+// Returns: the number of boards in the fleet
+int RelayFleet::size() {
+    return boards.size();
+}
+
+// Returns the board at an index of the fleet
+// Parameters: index - the index returned by add
+// Returns: the board, nullptr if there is no such board
+Usbmrelay* RelayFleet::board(int index) {
+    if (index < 0 || index >= (int)boards.size())
+        return nullptr;
+    return boards[index].get();
+}
+
+// Brings up one board of the fleet
+// Parameters: index - the index of the board
+//             start - the start of the bootstrap
+//             ready - the readiness callback
+//             nready - counts the boards ready
+Task<void> RelayFleet::bootBoard(int index, TimePoint start, const RelayReadyCallback& ready, int& nready) {
+    Usbmrelay* board = boards[index].get();
+    const RelayBoardConfig& config = configs[index];
+    RelayBoardReady report = {index, 1, false, 0};
+    board->setStateFile(config.statefile);
+    if (board->openCom() != 1) {
+        report.status = -1;
+    }
+    else {
+        if (config.delay >= 0)
+            board->setDelay(config.delay);
+        if (!board->isInitialized()) {
+            report.initialized = true;
+            if (co_await board->initBoardAsync() != 1)
+                report.status = -2;
+        }
+    }
+    if (report.status == 1)
+        nready++;
+    report.readyms = std::chrono::duration<double, std::milli>(SteadyClock::now() - start).count();
+    if (ready)
+        ready(report);
+}
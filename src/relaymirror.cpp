@@ -0,0 +1,253 @@
+#include <relaymirror.hpp>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#if defined (__linux__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const char mirrorMagic[8] = {'U', 'S', 'B', 'R', 'M', 'I', 'R', '1'};
+static const uint32_t mirrorVersion = 2;
+
+static_assert(sizeof(RelayStateMirror::Slot) == 128, "unexpected mirror slot size");
+
+// Returns: the size of a segment holding a number of boards
+static size_t segmentSize(int boardcount) {
+    return offsetof(RelayStateMirror::Layout, slots) + boardcount * sizeof(RelayStateMirror::Slot);
+}
+
+// Constructor, nothing is published until open is called
+RelayStateMirror::RelayStateMirror() {
+}
+
+// Destructor, unmaps and removes the segment
+RelayStateMirror::~RelayStateMirror() {
+    close();
+}
+
+// Creates the shared memory segment, replacing a segment left by a previous run
+// Parameters: name - the name of the segment, starting with /, for example "/usbrelay"
+//             boardcount - the number of slots, up to RELAYMIRROR_MAX_BOARDS
+// Returns: 1 if the segment is mapped, -1 otherwise
+int RelayStateMirror::open(const std::string& name, int boardcount) {
+    close();
+#if defined (__linux__) || defined(__APPLE__)
+    if (boardcount < 1 || boardcount > RELAYMIRROR_MAX_BOARDS)
+        return -1;
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return -1;
+    size_t size = segmentSize(boardcount);
+    if (ftruncate(fd, size) != 0) {
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return -1;
+    }
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return -1;
+    }
+    // The new segment is zeroed: every slot is unused
+    this->segment = (Layout*)map;
+    this->size = size;
+    this->name = name;
+    this->segment->version = mirrorVersion;
+    this->segment->boardcount = boardcount;
+    this->segment->ownerpid = getpid();
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(this->segment->magic, mirrorMagic, sizeof(mirrorMagic)); // Readers check the magic last
+    return 1;
+#else
+    (void)name;
+    (void)boardcount;
+    return -1;
+#endif
+}
+
+// Unmaps and removes the segment, the readers keep their mapping
+void RelayStateMirror::close() {
+#if defined (__linux__) || defined(__APPLE__)
+    if (this->segment != nullptr) {
+        munmap(this->segment, this->size);
+        shm_unlink(this->name.c_str());
+    }
+#endif
+    this->segment = nullptr;
+    this->size = 0;
+}
+
+// Returns: true if a segment is mapped
+bool RelayStateMirror::isOpen() {
+    return this->segment != nullptr;
+}
+
+// Takes the seqlock of a slot for writing, with a compare-and-swap: the slot has one writer
+// at a time, even when several threads publish to it
+// Parameters: entry - the slot
+//             seqlock - receives the value of the seqlock before it was taken, even
+// Returns: true if taken, false if another thread is writing the slot
+static bool lockSlot(RelayStateMirror::Slot& entry, uint32_t& seqlock) {
+    seqlock = entry.seqlock.load(std::memory_order_relaxed);
+    if ((seqlock & 1) || !entry.seqlock.compare_exchange_strong(seqlock, seqlock + 1, std::memory_order_acquire,
+                                                                 std::memory_order_relaxed))
+        return false;
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+}
+
+// Assigns a slot to a board and resets its state
+// Parameters: slot - the slot, from 0 to boardcount - 1
+//             port - the port of the board
+//             relaynumber - the number of relays of the board, 0 to free the slot
+// Returns: 1 if successful, -1 if there is no such slot
+int RelayStateMirror::describe(int slot, const std::string& port, int relaynumber) {
+    if (this->segment == nullptr || slot < 0 || slot >= (int)this->segment->boardcount)
+        return -1;
+    Slot& entry = this->segment->slots[slot];
+    uint32_t seqlock;
+    while (!lockSlot(entry, seqlock)) // A publish is a few stores
+        std::this_thread::yield();
+    memset(entry.port, 0, sizeof(entry.port));
+    strncpy(entry.port, port.c_str(), sizeof(entry.port) - 1);
+    entry.relaynumber.store(relaynumber, std::memory_order_relaxed);
+    entry.state.store(0, std::memory_order_relaxed);
+    entry.sequence.store(0, std::memory_order_relaxed);
+    entry.timestamp_ns.store(0, std::memory_order_relaxed);
+    entry.seqlock.store(seqlock + 2, std::memory_order_release);
+    return 1;
+}
+
+// Publishes the state of a board, without waiting: a publish which finds another thread
+// writing the slot gives up. The sequence number and the timestamp only change with the state.
+// Parameters: slot - the slot of the board
+//             state - the relay states, bit i for relay i+1
+// Returns: 1 if the state is published or unchanged, -1 if there is no such slot, -2 if
+//          another thread is writing the slot
+int RelayStateMirror::publish(int slot, uint64_t state) {
+    if (this->segment == nullptr || slot < 0 || slot >= (int)this->segment->boardcount)
+        return -1;
+    Slot& entry = this->segment->slots[slot];
+    uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    uint32_t seqlock;
+    if (!lockSlot(entry, seqlock))
+        return -2;
+    if (entry.state.load(std::memory_order_relaxed) == state && entry.sequence.load(std::memory_order_relaxed) != 0) {
+        entry.seqlock.store(seqlock, std::memory_order_release); // Nothing written
+        return 1;
+    }
+    entry.state.store(state, std::memory_order_relaxed);
+    entry.sequence.store(entry.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    entry.timestamp_ns.store(now, std::memory_order_relaxed);
+    entry.seqlock.store(seqlock + 2, std::memory_order_release);
+    return 1;
+}
+
+// Constructor, open must be called before reading
+RelayStateMirrorReader::RelayStateMirrorReader() {
+}
+
+// Destructor, unmaps the segment
+RelayStateMirrorReader::~RelayStateMirrorReader() {
+    close();
+}
+
+// Maps a segment created by a RelayStateMirror, read only
+// Parameters: name - the name of the segment
+// Returns: 1 if the segment is mapped, -1 if it does not exist, -2 if it is not a mirror
+int RelayStateMirrorReader::open(const std::string& name) {
+    close();
+#if defined (__linux__) || defined(__APPLE__)
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < (off_t)segmentSize(1)) {
+        ::close(fd);
+        return -2;
+    }
+    void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    const RelayStateMirror::Layout* layout = (const RelayStateMirror::Layout*)map;
+    if (memcmp(layout->magic, mirrorMagic, sizeof(mirrorMagic)) != 0 || layout->version != mirrorVersion
+        || segmentSize(layout->boardcount) > (size_t)size) {
+        munmap(map, size);
+        return -2;
+    }
+    this->segment = layout;
+    this->size = size;
+    return 1;
+#else
+    (void)name;
+    return -1;
+#endif
+}
+
+// Unmaps the segment
+void RelayStateMirrorReader::close() {
+#if defined (__linux__) || defined(__APPLE__)
+    if (this->segment != nullptr)
+        munmap((void*)this->segment, this->size);
+#endif
+    this->segment = nullptr;
+    this->size = 0;
+}
+
+// Returns: the number of slots of the mirror, 0 if none is mapped
+int RelayStateMirrorReader::getBoardCount() {
+    return this->segment ? this->segment->boardcount : 0;
+}
+
+// Returns whether the process which created the segment still runs. Once it exits, the
+// segment is removed but stays mapped here, with the last states it published.
+// Returns: true if the owner runs, false if it exited or no segment is mapped
+bool RelayStateMirrorReader::isOwnerAlive() {
+#if defined (__linux__) || defined(__APPLE__)
+    if (this->segment == nullptr)
+        return false;
+    return kill(this->segment->ownerpid, 0) == 0 || errno == EPERM;
+#else
+    return this->segment != nullptr;
+#endif
+}
+
+// Takes a consistent snapshot of a board, retrying while the slot is written. The retries
+// are bounded: a publisher which died while writing leaves the slot locked for good.
+// Parameters: slot - the slot of the board
+//             snapshot - receives the state of the board
+// Returns: 1 if successful, -1 if there is no such slot or no board uses it, -2 if the slot
+//          stayed locked for RELAYMIRROR_READ_RETRIES attempts
+int RelayStateMirrorReader::read(int slot, RelayMirrorSnapshot& snapshot) {
+    if (this->segment == nullptr || slot < 0 || slot >= (int)this->segment->boardcount)
+        return -1;
+    const RelayStateMirror::Slot& entry = this->segment->slots[slot];
+    for (int attempt = 0; ; attempt++) {
+        if (attempt == RELAYMIRROR_READ_RETRIES)
+            return -2;
+        if (attempt > 0) // Let the publisher finish
+            std::this_thread::yield();
+        uint32_t before = entry.seqlock.load(std::memory_order_acquire);
+        if (before & 1)
+            continue;
+        snapshot.relaynumber = entry.relaynumber.load(std::memory_order_relaxed);
+        snapshot.state = entry.state.load(std::memory_order_relaxed);
+        snapshot.sequence = entry.sequence.load(std::memory_order_relaxed);
+        snapshot.timestamp_ns = entry.timestamp_ns.load(std::memory_order_relaxed);
+        memcpy(snapshot.port, entry.port, sizeof(snapshot.port));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (entry.seqlock.load(std::memory_order_relaxed) == before)
+            break;
+    }
+    snapshot.port[sizeof(snapshot.port) - 1] = 0;
+    return snapshot.relaynumber > 0 ? 1 : -1;
+}
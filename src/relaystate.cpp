@@ -0,0 +1,164 @@
+#include <relaystate.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+#if defined (__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const char stateMagic[8] = {'U', 'S', 'B', 'R', 'S', 'T', 'A', '1'};
+static const uint32_t stateVersion = 3;
+
+// Constructor, no file is mapped until open is called
+RelayStateStore::RelayStateStore() {
+}
+
+// Destructor, unmaps the file
+RelayStateStore::~RelayStateStore() {
+    close();
+}
+
+// Maps the state file of a board, creating it if needed
+// A file written for another device or relay number is reset
+// Parameters: path - the state file
+//             device - the port of the board
+//             relaynumber - the number of relays on the board
+// Returns: 1 if the file is mapped, -1 otherwise
+int RelayStateStore::open(const std::string& path, const std::string& device, int relaynumber) {
+    close();
+#if defined (__linux__) || defined(__APPLE__)
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, sizeof(Layout)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    void* map = mmap(nullptr, sizeof(Layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    this->file = (Layout*)map;
+
+    char name[sizeof(this->file->device)] = {0};
+    strncpy(name, device.c_str(), sizeof(name) - 1);
+    if (memcmp(this->file->magic, stateMagic, sizeof(stateMagic)) != 0
+        || this->file->version != stateVersion
+        || this->file->relaynumber != (uint32_t)relaynumber
+        || memcmp(this->file->device, name, sizeof(name)) != 0) {
+        // New file or file of another board: start from an empty snapshot
+        memset(this->file, 0, sizeof(Layout));
+        memcpy(this->file->magic, stateMagic, sizeof(stateMagic));
+        this->file->version = stateVersion;
+        this->file->relaynumber = relaynumber;
+        this->file->delay = -1;
+        memcpy(this->file->device, name, sizeof(name));
+    }
+    return 1;
+#else
+    (void)path;
+    (void)device;
+    (void)relaynumber;
+    return -1;
+#endif
+}
+
+// Unmaps the state file, the last snapshot stays on disk
+void RelayStateStore::close() {
+#if defined (__linux__) || defined(__APPLE__)
+    if (this->file != nullptr)
+        munmap(this->file, sizeof(Layout));
+#endif
+    this->file = nullptr;
+}
+
+// Returns: true if a state file is mapped
+bool RelayStateStore::isOpen() {
+    return this->file != nullptr;
+}
+
+// Computes the checksum of a slot (FNV-1a over every field before the checksum)
+uint32_t RelayStateStore::checksum(const Slot& slot) {
+    uint32_t hash = 2166136261u;
+    const unsigned char* bytes = (const unsigned char*)&slot;
+    for (size_t i = 0; i < offsetof(Slot, checksum); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+// Returns: the valid slot with the highest sequence number, nullptr if none
+const RelayStateStore::Slot* RelayStateStore::latest() {
+    const Slot* best = nullptr;
+    for (const Slot& slot : this->file->slots) {
+        if (slot.sequence == 0 || slot.checksum != checksum(slot))
+            continue;
+        if (best == nullptr || slot.sequence > best->sequence)
+            best = &slot;
+    }
+    return best;
+}
+
+// Reads the last snapshot
+// Parameters: state - receives the relay states, bit i for relay i+1
+//             initialized - receives the init status of the board
+//             devicestamp - receives the identity of the device connection the snapshot belongs to
+// Returns: 1 if a snapshot was found, -1 otherwise
+int RelayStateStore::load(uint64_t& state, bool& initialized, uint64_t& devicestamp) {
+    if (this->file == nullptr)
+        return -1;
+    const Slot* slot = latest();
+    if (slot == nullptr)
+        return -1;
+    state = slot->state;
+    initialized = slot->initialized != 0;
+    devicestamp = slot->devicestamp;
+    return 1;
+}
+
+// Writes a new snapshot in the older slot, the newer one stays valid until it is complete
+// Parameters: state - the relay states, bit i for relay i+1
+//             initialized - the init status of the board
+//             devicestamp - the identity of the current device connection
+// Returns: 1 if the snapshot is written, -1 if no file is mapped
+int RelayStateStore::save(uint64_t state, bool initialized, uint64_t devicestamp) {
+    if (this->file == nullptr)
+        return -1;
+    const Slot* current = latest();
+    uint64_t sequence = current ? current->sequence + 1 : 1;
+    Slot& slot = this->file->slots[sequence & 1];
+    // Invalidate the slot first, so that a crash leaves either the old or the new snapshot
+    slot.sequence = 0;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    slot.state = state;
+    slot.devicestamp = devicestamp;
+    slot.initialized = initialized ? 1 : 0;
+    Slot next = slot;
+    next.sequence = sequence;
+    slot.checksum = checksum(next);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    slot.sequence = sequence;
+    return 1;
+}
+
+// Reads the calibrated inter-frame delay of the board
+// Parameters: delay - receives the delay in milliseconds
+// Returns: 1 if a delay was saved, -1 otherwise
+int RelayStateStore::loadDelay(int& delay) {
+    if (this->file == nullptr || this->file->delay < 0)
+        return -1;
+    delay = this->file->delay;
+    return 1;
+}
+
+// Saves the calibrated inter-frame delay of the board, a single aligned store
+// Parameters: delay - the delay in milliseconds, -1 to forget it
+// Returns: 1 if the delay is written, -1 if no file is mapped
+int RelayStateStore::saveDelay(int delay) {
+    if (this->file == nullptr)
+        return -1;
+    this->file->delay = delay;
+    return 1;
+}
@@ -0,0 +1,110 @@
+#include <relaywatchdog.hpp>
+#include <algorithm>
+
+
+
+// Period at which the monitor checks for stop requests and new feeds once tripped
+static const std::chrono::milliseconds monitorPeriod(50);
+
+// Returns: the current time of the steady clock in nanoseconds
+static int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Constructor, no board is watched until addBoard is called
+RelayWatchdog::RelayWatchdog() {
+}
+
+// Destructor, stops the monitor thread
+RelayWatchdog::~RelayWatchdog() {
+    stop();
+}
+
+// Adds a board to the watched boards, before start
+// Parameters: board - an open board, must outlive the watchdog
+// Returns: 1 if successful, -1 if the watchdog is running
+int RelayWatchdog::addBoard(Usbmrelay* board) {
+    if (running.load())
+        return -1;
+    boards.push_back(board);
+    return 1;
+}
+
+// Starts the monitor thread, the watchdog is fed once on start
+// Parameters: timeoutms - the longest time allowed between two feeds, in milliseconds
+// Returns: 1 if successful, -1 if the watchdog is already running
+int RelayWatchdog::start(unsigned int timeoutms) {
+    if (running.load())
+        return -1;
+    timeout_ns = (int64_t)timeoutms * 1000000;
+    plans.assign(boards.size(), RelayFailSafePlan()); // The monitor does not allocate
+    tripped.store(false);
+    feed();
+    running.store(true);
+    thread = std::thread(&RelayWatchdog::monitor, this);
+    return 1;
+}
+
+// Stops the monitor thread
+void RelayWatchdog::stop() {
+    running.store(false);
+    if (thread.joinable())
+        thread.join();
+}
+
+// Returns whether the relays have been switched off since the last feed
+// Returns: true if the watchdog has tripped and has not been fed since
+bool RelayWatchdog::hasTripped() {
+    return tripped.load(std::memory_order_acquire);
+}
+
+// Returns: the number of times the watchdog has tripped since it was created
+uint64_t RelayWatchdog::getTripCount() {
+    return trips.load(std::memory_order_acquire);
+}
+
+// Body of the monitor thread: trips once per missed deadline, and re-arms on the next feed
+void RelayWatchdog::monitor() {
+    int64_t trippedfeed = 0; // Feed which was missing when the watchdog tripped
+    while (running.load(std::memory_order_acquire)) {
+        int64_t fed = lastfeed.load(std::memory_order_acquire);
+        if (tripped.load(std::memory_order_relaxed)) {
+            if (fed != trippedfeed) // Fed again: re-arm
+                tripped.store(false, std::memory_order_release);
+            else
+                std::this_thread::sleep_for(monitorPeriod);
+            continue;
+        }
+        int64_t now = nowNs();
+        int64_t deadline = fed + timeout_ns;
+        if (now < deadline) {
+            std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(
+                std::chrono::nanoseconds(deadline - now), monitorPeriod));
+            continue;
+        }
+        failSafe();
+        trippedfeed = fed;
+        trips.fetch_add(1, std::memory_order_acq_rel);
+        tripped.store(true, std::memory_order_release);
+    }
+}
+
+// Writes the all-off frames to every board: frame k of each board, then the longest delay,
+// so that the boards are switched off in parallel. The frame plan of each board is taken once,
+// the frames written are the ones of this plan even if a delay changes meanwhile.
+void RelayWatchdog::failSafe() {
+    int framecount = 0;
+    int framedelay = 0;
+    for (size_t b = 0; b < boards.size(); b++) {
+        plans[b] = boards[b]->getFailSafePlan();
+        framecount = std::max(framecount, plans[b].frames);
+        framedelay = std::max(framedelay, plans[b].delayms);
+    }
+    for (int k = 0; k < framecount; k++) {
+        for (size_t b = 0; b < boards.size(); b++)
+            boards[b]->writeFailSafeFrame(k, plans[b]);
+        if (framedelay > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(framedelay));
+    }
+}
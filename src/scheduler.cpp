@@ -0,0 +1,146 @@
+#include <scheduler.hpp>
+#include <algorithm>
+
+#if defined (__linux__) || defined(__APPLE__)
+#include <poll.h>
+#include <time.h>
+#else
+#include <windows.h>
+#endif
+
+static thread_local Scheduler* currentScheduler = nullptr;
+
+// Constructor of the scheduler, nothing runs until run is called
+Scheduler::Scheduler() {
+    this->timerOrder = 0;
+}
+
+// Destructor, coroutines which have not finished are destroyed
+Scheduler::~Scheduler() {
+}
+
+// Returns the scheduler running on the current thread
+// Returns: the scheduler, nullptr if no scheduler is running
+Scheduler* Scheduler::current() {
+    return currentScheduler;
+}
+
+// Adds a coroutine to the scheduler, it starts on the next call to run
+// Parameters: task - the coroutine to run, owned by the scheduler until it finishes
+void Scheduler::spawn(Task<void> task) {
+    if (task.done())
+        return;
+    this->ready.push_back(task.handle);
+    this->tasks.push_back(std::move(task));
+}
+
+// Resumes a coroutine on the next iteration of the event loop
+// Parameters: handle - the coroutine to resume
+void Scheduler::schedule(std::coroutine_handle<> handle) {
+    this->ready.push_back(handle);
+}
+
+// Resumes a coroutine once a point in time is reached
+// Parameters: deadline - the time at which the coroutine is resumed
+//             handle - the coroutine to resume
+void Scheduler::addTimer(TimePoint deadline, std::coroutine_handle<> handle) {
+    this->timers.push(Timer{deadline, this->timerOrder++, handle});
+}
+
+// Resumes a coroutine when a file descriptor is ready or when the deadline is reached
+// Parameters: fd - the file descriptor to watch
+//             events - the poll events to wait for
+//             deadline - the time at which the coroutine is resumed if the descriptor is not ready
+//             handle - the coroutine to resume
+//             revents - receives the poll events of the descriptor, 0 on timeout
+void Scheduler::addWait(int fd, short events, TimePoint deadline, std::coroutine_handle<> handle, short* revents) {
+    this->waits.push_back(Wait{fd, events, deadline, handle, revents});
+}
+
+// Runs the event loop until every spawned coroutine has finished
+void Scheduler::run() {
+    Scheduler* previous = currentScheduler;
+    currentScheduler = this;
+    while (true) {
+        while (!this->ready.empty()) {
+            std::coroutine_handle<> handle = this->ready.front();
+            this->ready.pop_front();
+            handle.resume();
+        }
+        this->tasks.erase(std::remove_if(this->tasks.begin(), this->tasks.end(),
+                                         [](const Task<void>& task) { return task.done(); }),
+                          this->tasks.end());
+        if (this->tasks.empty() || (this->timers.empty() && this->waits.empty()))
+            break;
+        this->poll(SteadyClock::now());
+    }
+    currentScheduler = previous;
+}
+
+// Waits for the next timer or file descriptor and moves the coroutines concerned to the ready queue
+// Parameters: now - the current time
+void Scheduler::poll(TimePoint now) {
+    TimePoint next = TimePoint::max();
+    if (!this->timers.empty())
+        next = this->timers.top().deadline;
+    for (const Wait& wait : this->waits)
+        next = std::min(next, wait.deadline);
+
+    if (next > now) {
+        auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(next - now);
+#if defined (__linux__) || defined(__APPLE__)
+        static thread_local std::vector<struct pollfd> pfds;
+        pfds.clear();
+        for (const Wait& wait : this->waits)
+            pfds.push_back({wait.fd, wait.events, 0});
+        struct timespec timeout;
+        timeout.tv_sec = remaining.count() / 1000000000;
+        timeout.tv_nsec = remaining.count() % 1000000000;
+        bool forever = next == TimePoint::max();
+        int ret = ::ppoll(pfds.data(), pfds.size(), forever ? nullptr : &timeout, nullptr);
+        if (ret > 0) {
+            for (size_t i = 0; i < pfds.size(); i++)
+                *this->waits[i].revents = pfds[i].revents;
+        }
+#else
+        // No file descriptor to wait for on Windows, only the timers
+        Sleep((DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count());
+#endif
+        now = SteadyClock::now();
+    }
+
+    while (!this->timers.empty() && this->timers.top().deadline <= now) {
+        this->ready.push_back(this->timers.top().handle);
+        this->timers.pop();
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < this->waits.size(); i++) {
+        Wait& wait = this->waits[i];
+        if (*wait.revents != 0 || wait.deadline <= now)
+            this->ready.push_back(wait.handle);
+        else
+            this->waits[kept++] = wait;
+    }
+    this->waits.resize(kept);
+}
+
+// Suspends the calling coroutine until a point in time
+// Parameters: deadline - the time at which the coroutine is resumed
+SleepAwaiter sleep_until(TimePoint deadline) {
+    return SleepAwaiter{deadline};
+}
+
+// Suspends the calling coroutine for a duration
+// Parameters: duration - the time to wait
+SleepAwaiter sleep_for(std::chrono::nanoseconds duration) {
+    return SleepAwaiter{SteadyClock::now() + duration};
+}
+
+// Suspends the calling coroutine until a file descriptor is ready
+// Parameters: fd - the file descriptor to watch
+//             events - the poll events to wait for
+//             deadline - the time at which the coroutine is resumed if the descriptor is not ready
+// Returns: an awaiter returning the poll events, 0 on timeout
+WaitFdAwaiter wait_fd(int fd, short events, TimePoint deadline) {
+    return WaitFdAwaiter{fd, events, deadline};
+}
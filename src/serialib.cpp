@@ -16,6 +16,9 @@ This is a licence-free software, it can be used by anyone who try to build a bet
  */
 
 #include "serialib.hpp"
+#include "serialuring.hpp"
+#include "scheduler.hpp"
+#include "serialtracer.hpp"
 
 
 
@@ -28,6 +31,8 @@ This is a licence-free software, it can be used by anyone who try to build a bet
 */
 serialib::serialib()
 {
+    tracer = NULL;
+    tracePort = 0;
 #if defined (_WIN32) || defined( _WIN64)
     // Set default value for RTS and DTR (Windows only)
     currentStateRTS=true;
@@ -36,6 +41,12 @@ serialib::serialib()
 #endif
 #if defined (__linux__) || defined(__APPLE__)
     fd = -1;
+    currentStateRTS=false;
+    currentStateDTR=false;
+    modemControl = 0;
+    ioEngine = NULL;
+    rxHead = 0;
+    rxTail = 0;
 #endif
 }
 
@@ -349,6 +360,12 @@ char serialib::openDevice(const char *Device, const unsigned int Bauds,
     options.c_cc[VMIN]=0;
     // Activate the settings
     tcsetattr(fd, TCSANOW, &options);
+    // Keep the output bits of the modem control register, so that setLines needs a single ioctl
+    modemControl=0;
+    ioctl(fd, TIOCMGET, &modemControl);
+    modemControl &= ~(TIOCM_CTS | TIOCM_CAR | TIOCM_RNG | TIOCM_DSR);
+    currentStateDTR = modemControl & TIOCM_DTR;
+    currentStateRTS = modemControl & TIOCM_RTS;
     // Success
     return (1);
 #endif
@@ -377,6 +394,9 @@ void serialib::closeDevice()
 #if defined (__linux__) || defined(__APPLE__)
     close (fd);
     fd = -1;
+    // Drop the bytes buffered from the previous device
+    rxHead = 0;
+    rxTail = 0;
 #endif
 }
 
@@ -391,27 +411,15 @@ void serialib::closeDevice()
 /*!
      \brief Write a char on the current serial port
      \param Byte : char to send on the port (must be terminated by '\0')
+     \param timeOut_ms : delay given to the driver to accept the char (optional)
      \return 1 success
      \return -1 error while writting data
+     \return -2 timeout reached
   */
-int serialib::writeChar(const char Byte)
+int serialib::writeChar(const char Byte,const unsigned int timeOut_ms)
 {
-#if defined (_WIN32) || defined( _WIN64)
-    // Number of bytes written
-    DWORD dwBytesWritten;
-    // Write the char to the serial device
-    // Return -1 if an error occured
-    if(!WriteFile(hSerial,&Byte,1,&dwBytesWritten,NULL)) return -1;
-    // Write operation successfull
-    return 1;
-#endif
-#if defined (__linux__) || defined(__APPLE__)
     // Write the char
-    if (write(fd,&Byte,1)!=1) return -1;
-
-    // Write operation successfull
-    return 1;
-#endif
+    return writeBytes(&Byte,1,timeOut_ms);
 }
 
 
@@ -423,29 +431,15 @@ int serialib::writeChar(const char Byte)
 /*!
      \brief     Write a string on the current serial port
      \param     receivedString : string to send on the port (must be terminated by '\0')
+     \param     timeOut_ms : delay given to the driver to accept the whole string (optional)
      \return     1 success
      \return    -1 error while writting data
+     \return    -2 timeout reached
   */
-int serialib::writeString(const char *receivedString)
+int serialib::writeString(const char *receivedString,const unsigned int timeOut_ms)
 {
-#if defined (_WIN32) || defined( _WIN64)
-    // Number of bytes written
-    DWORD dwBytesWritten;
     // Write the string
-    if(!WriteFile(hSerial,receivedString,strlen(receivedString),&dwBytesWritten,NULL))
-        // Error while writing, return -1
-        return -1;
-    // Write operation successfull
-    return 1;
-#endif
-#if defined (__linux__) || defined(__APPLE__)
-    // Lenght of the string
-    int Lenght=strlen(receivedString);
-    // Write the string
-    if (write(fd,receivedString,Lenght)!=Lenght) return -1;
-    // Write operation successfull
-    return 1;
-#endif
+    return writeBytes(receivedString,strlen(receivedString),timeOut_ms);
 }
 
 // _____________________________________
@@ -457,10 +451,175 @@ int serialib::writeString(const char *receivedString)
      \brief Write an array of data on the current serial port
      \param Buffer : array of bytes to send on the port
      \param NbBytes : number of byte to send
+     \param timeOut_ms : delay given to the driver to accept all the bytes (optional)
+     \return 1 success
+     \return -1 error while writting data
+     \return -2 timeout reached
+  */
+int serialib::writeBytes(const void *Buffer, const unsigned int NbBytes, const unsigned int timeOut_ms)
+{
+    struct iovec iov;
+    iov.iov_base=(void*)Buffer;
+    iov.iov_len=NbBytes;
+    // Write data
+    return writeBytesv(&iov,1,timeOut_ms);
+}
+
+
+
+/*!
+     \brief Write several arrays of data on the current serial port in a single operation
+            On Unix the arrays are handed to writev(). Since the device is opened
+            in non-blocking mode, short writes are resumed where they stopped and
+            the function waits with poll() until the driver accepts more data.
+            On Windows the short writes of WriteFile are resumed the same way.
+     \param Iov : arrays of bytes to send on the port
+     \param IovCount : number of arrays
+     \param timeOut_ms : delay given to the driver to accept all the bytes (optional)
+            If set to zero, timeout is disable
      \return 1 success
      \return -1 error while writting data
+     \return -2 timeout reached, the data has been partially written
   */
-int serialib::writeBytes(const void *Buffer, const unsigned int NbBytes)
+int serialib::writeBytesv(const struct iovec *Iov, const int IovCount, const unsigned int timeOut_ms)
+{
+#if defined (_WIN32) || defined( _WIN64)
+    // Timer used for timeout
+    timeOut         timer;
+    timer.initTimer();
+    for (int i=0;i<IovCount;i++)
+    {
+        // Short writes (write timeout of the port) are resumed where they stopped
+        size_t offset=0;
+        while (offset<Iov[i].iov_len)
+        {
+            // Number of bytes written
+            DWORD dwBytesWritten;
+            // Write data
+            if(!WriteFile(hSerial, (const char*)Iov[i].iov_base+offset, (DWORD)(Iov[i].iov_len-offset), &dwBytesWritten, NULL))
+                // Error while writing, return -1
+                return -1;
+            traceTx((const char*)Iov[i].iov_base+offset,dwBytesWritten);
+            offset+=dwBytesWritten;
+            if (offset<Iov[i].iov_len && timeOut_ms!=0 && timer.elapsedTime_ms()>=timeOut_ms)
+                // Timeout reached, the data has been partially written
+                return -2;
+        }
+    }
+    // Write operation successfull
+    return 1;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    // Timer used for timeout
+    timeOut         timer;
+    timer.initTimer();
+    // Current array and offset inside this array
+    int             index=0;
+    size_t          offset=0;
+
+    while (true)
+    {
+        // Skip the arrays already written
+        while (index<IovCount && offset>=Iov[index].iov_len)
+        {
+            offset-=Iov[index].iov_len;
+            index++;
+        }
+        // Every byte has been written
+        if (index==IovCount) return 1;
+
+        // Build the remaining part of the request
+        struct iovec    pending[SERIALIB_IOV_MAX];
+        int             nbPending=0;
+        while (nbPending<SERIALIB_IOV_MAX && index+nbPending<IovCount)
+        {
+            pending[nbPending]=Iov[index+nbPending];
+            nbPending++;
+        }
+        pending[0].iov_base=(char*)pending[0].iov_base+offset;
+        pending[0].iov_len-=offset;
+
+        // Write data
+        ssize_t nbWritten;
+#if defined (__linux__)
+        if (ioEngine!=NULL)
+        {
+            // The ring waits for the device itself, bounded by the remaining time
+            unsigned int remaining=0;
+            if (timeOut_ms!=0)
+            {
+                long int timeOutParam=(long int)timeOut_ms-(long int)timer.elapsedTime_ms();
+                if (timeOutParam<=0) return -2;
+                remaining=timeOutParam;
+            }
+            uint64_t tag=(uintptr_t)this;
+            if (ioEngine->queueWrite(fd,pending,nbPending,remaining,tag)!=1) return -1;
+            int ret=ioEngine->waitFor(tag);
+            if (ret==-ETIME) return -2;
+            // -EAGAIN on kernels that do not wait on non-blocking files: poll below
+            if (ret<0) errno=-ret;
+            nbWritten=ret<0 ? -1 : ret;
+        }
+        else
+#endif
+        nbWritten=writev(fd,pending,nbPending);
+        if (nbWritten>0)
+        {
+            // Record the part of each array which has been written
+            size_t traced=0;
+            for (int i=0;i<nbPending && traced<(size_t)nbWritten;i++)
+            {
+                size_t length=pending[i].iov_len;
+                if (length>(size_t)nbWritten-traced) length=nbWritten-traced;
+                traceTx(pending[i].iov_base,length);
+                traced+=length;
+            }
+            offset+=nbWritten;
+            continue;
+        }
+        if (nbWritten<0 && errno==EINTR) continue;
+        if (nbWritten<0 && errno!=EAGAIN && errno!=EWOULDBLOCK) return -1;
+
+        // The driver buffer is full, wait until it can accept more data
+        int timeOutParam=-1;
+        if (timeOut_ms!=0)
+        {
+            long int remaining=(long int)timeOut_ms-(long int)timer.elapsedTime_ms();
+            if (remaining<=0) return -2;
+            timeOutParam=remaining;
+        }
+        struct pollfd pfd;
+        pfd.fd=fd;
+        pfd.events=POLLOUT;
+        pfd.revents=0;
+        int ret=poll(&pfd,1,timeOutParam);
+        if (ret<0 && errno!=EINTR) return -1;
+        if (ret>0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+        {
+            // The device is gone (hung up) or the port is closed
+            errno=(pfd.revents & POLLNVAL) ? EBADF : EIO;
+            return -1;
+        }
+    }
+#endif
+}
+
+
+
+/*!
+     rief Write an array of data with a single call to the driver, which never waits
+            for room in the driver buffer (no poll, no I/O ring). Meant for short urgent
+            data which may be dropped, like a fail-safe frame written by another thread.
+     \param Buffer : array of bytes to send on the port
+     \param NbBytes : number of byte to send
+     
+eturn 1 success
+     
+eturn -1 error while writting data
+     
+eturn -2 the driver did not accept every byte, the data may be partially written
+  */
+int serialib::tryWriteBytes(const void *Buffer, const unsigned int NbBytes)
 {
 #if defined (_WIN32) || defined( _WIN64)
     // Number of bytes written
@@ -469,14 +628,14 @@ int serialib::writeBytes(const void *Buffer, const unsigned int NbBytes)
     if(!WriteFile(hSerial, Buffer, NbBytes, &dwBytesWritten, NULL))
         // Error while writing, return -1
         return -1;
-    // Write operation successfull
-    return 1;
+    traceTx(Buffer,dwBytesWritten);
+    return dwBytesWritten==NbBytes ? 1 : -2;
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Write data
-    if (write (fd,Buffer,NbBytes)!=(ssize_t)NbBytes) return -1;
-    // Write operation successfull
-    return 1;
+    ssize_t nbWritten=write(fd,Buffer,NbBytes);
+    if (nbWritten<0) return (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR) ? -2 : -1;
+    traceTx(Buffer,nbWritten);
+    return (size_t)nbWritten==NbBytes ? 1 : -2;
 #endif
 }
 
@@ -509,6 +668,7 @@ int serialib::readChar(char *pByte,unsigned int timeOut_ms)
 
     // Return 0 if the timeout is reached
     if (dwBytesRead==0) return 0;
+    traceRx(pByte,1);
 
     // The byte is read
     return 1;
@@ -518,16 +678,22 @@ int serialib::readChar(char *pByte,unsigned int timeOut_ms)
     timeOut         timer;
     // Initialise the timer
     timer.initTimer();
-    // While Timeout is not reached
-    while (timer.elapsedTime_ms()<timeOut_ms || timeOut_ms==0)
+    // While the internal buffer is empty
+    while (rxHead==rxTail)
     {
-        // Try to read a byte on the device
-        switch (read(fd,pByte,1)) {
-        case 1  : return 1; // Read successfull
-        case -1 : return -2; // Error while reading
+        // Compute the remaining time (-1 waits forever)
+        long int timeOutParam=-1;
+        if (timeOut_ms!=0)
+        {
+            timeOutParam=(long int)timeOut_ms-(long int)timer.elapsedTime_ms();
+            if (timeOutParam<=0) return 0;
         }
+        // Wait for the device and buffer everything available
+        if (fillRxBuffer(timeOutParam)<0) return -2;
     }
-    return 0;
+    // Take the oldest buffered byte
+    *pByte=rxBuffer[rxHead++];
+    return 1;
 #endif
 }
 
@@ -545,6 +711,11 @@ int serialib::readChar(char *pByte,unsigned int timeOut_ms)
   */
 int serialib::readStringNoTimeOut(char *receivedString,char finalChar,unsigned int maxNbBytes)
 {
+#if defined (__linux__) || defined(__APPLE__)
+    // Search the final char in the internal buffer, wait forever
+    return readStringBuffered(receivedString,finalChar,maxNbBytes,-1);
+#endif
+#if defined (_WIN32) || defined(_WIN64)
     // Number of characters read
     unsigned int    NbBytes=0;
     // Returned value from Read
@@ -577,6 +748,7 @@ int serialib::readStringNoTimeOut(char *receivedString,char finalChar,unsigned i
     }
     // Buffer is full : return -3
     return -3;
+#endif
 }
 
 
@@ -597,6 +769,11 @@ int serialib::readString(char *receivedString,char finalChar,unsigned int maxNbB
     // Check if timeout is requested
     if (timeOut_ms==0) return readStringNoTimeOut(receivedString,finalChar,maxNbBytes);
 
+#if defined (__linux__) || defined(__APPLE__)
+    // Search the final char in the internal buffer
+    return readStringBuffered(receivedString,finalChar,maxNbBytes,timeOut_ms);
+#endif
+#if defined (_WIN32) || defined(_WIN64)
     // Number of bytes read
     unsigned int    nbBytes=0;
     // Character read on serial device
@@ -648,11 +825,167 @@ int serialib::readString(char *receivedString,char finalChar,unsigned int maxNbB
         }
     }
 
+    // Buffer is full : return -3
+    return -3;
+#endif
+}
+
+
+#if defined (__linux__) || defined(__APPLE__)
+/*!
+     \brief Read a string using the internal receive buffer (Unix only)
+            Every available byte is read with a single call to read(), the final
+            char is searched with memchr() (vectorized by the C library) and the
+            bytes following it are kept for the next read operation.
+     \param receivedString : string read on the serial device
+     \param finalChar : final char of the string
+     \param maxNbBytes : maximum allowed number of characters read
+     \param timeOut_ms : delay of timeout before giving up the reading, negative to wait forever
+     \return  >0 success, return the number of bytes read (including the null character)
+     \return  0 timeout is reached
+     \return -2 error while reading the character
+     \return -3 MaxNbBytes is reached
+  */
+int serialib::readStringBuffered(char *receivedString,char finalChar,unsigned int maxNbBytes,long int timeOut_ms)
+{
+    // Number of bytes read
+    unsigned int    nbBytes=0;
+    // Timer used for timeout
+    timeOut         timer;
+
+    // Initialize the timer (for timeout)
+    timer.initTimer();
+
+    // While the buffer is not full
+    while (nbBytes<maxNbBytes)
+    {
+        // Bytes already buffered
+        if (rxHead<rxTail)
+        {
+            // Number of bytes that can be copied
+            unsigned int nbCopy=rxTail-rxHead;
+            if (nbCopy>maxNbBytes-nbBytes) nbCopy=maxNbBytes-nbBytes;
+
+            // Look for the final char
+            const char *start=rxBuffer+rxHead;
+            const char *found=(const char*)memchr(start,finalChar,nbCopy);
+            if (found!=NULL) nbCopy=found-start+1;
+
+            // Move the bytes to the user string
+            memcpy(receivedString+nbBytes,start,nbCopy);
+            rxHead+=nbCopy;
+            nbBytes+=nbCopy;
+
+            if (found!=NULL)
+            {
+                // Final character: add the end character 0
+                receivedString[nbBytes]=0;
+                // Return the number of bytes read
+                return nbBytes;
+            }
+            continue;
+        }
+
+        // Compute the remaining time (-1 waits forever)
+        long int timeOutParam=-1;
+        if (timeOut_ms>=0)
+        {
+            timeOutParam=timeOut_ms-(long int)timer.elapsedTime_ms();
+            if (timeOutParam<=0)
+            {
+                // Add the end caracter
+                receivedString[nbBytes]=0;
+                // Return 0 (timeout reached)
+                return 0;
+            }
+        }
+
+        // Wait for new bytes
+        if (fillRxBuffer(timeOutParam)<0) return -2;
+    }
+
     // Buffer is full : return -3
     return -3;
 }
 
 
+/*!
+     \brief Wait for data on the device and append everything available to the internal buffer (Unix only)
+     \param timeOut_ms : maximum waiting time, negative to wait forever
+     \return >0 number of bytes added to the buffer
+     \return 0 no data before the timeout
+     \return -2 error while reading the device
+  */
+int serialib::fillRxBuffer(int timeOut_ms)
+{
+    // Move the pending bytes back to the start of the buffer
+    if (rxHead==rxTail)
+        rxHead=rxTail=0;
+    else if (rxHead>0)
+    {
+        memmove(rxBuffer,rxBuffer+rxHead,rxTail-rxHead);
+        rxTail-=rxHead;
+        rxHead=0;
+    }
+    // Buffer is full, let the caller consume it first
+    if (rxTail==SERIALIB_RX_BUFFER_SIZE) return 0;
+
+#if defined (__linux__)
+    if (ioEngine!=NULL && timeOut_ms!=0)
+    {
+        // Let the ring wait for the data, a zero timeout means no timeout for the engine
+        uint64_t tag=(uintptr_t)this;
+        if (ioEngine->queueRead(fd,rxBuffer+rxTail,SERIALIB_RX_BUFFER_SIZE-rxTail,timeOut_ms<0 ? 0 : timeOut_ms,tag)!=1) return -2;
+        int ret=ioEngine->waitFor(tag);
+        if (ret>0)
+        {
+            traceRx(rxBuffer+rxTail,ret);
+            rxTail+=ret;
+            return ret;
+        }
+        if (ret==0 || ret==-ETIME || ret==-EINTR) return 0;
+        if (ret!=-EAGAIN) return -2;
+        // The kernel does not wait on non-blocking files, use the classic path
+    }
+#endif
+
+    // Wait for the device to be readable
+    struct pollfd pfd;
+    pfd.fd=fd;
+    pfd.events=POLLIN;
+    pfd.revents=0;
+    int ret=poll(&pfd,1,timeOut_ms);
+    if (ret<0) return (errno==EINTR) ? 0 : -2;
+    if (ret==0) return 0;
+
+    // Read everything the driver has, in one call
+    ssize_t nbRead=read(fd,rxBuffer+rxTail,SERIALIB_RX_BUFFER_SIZE-rxTail);
+    if (nbRead<0) return (errno==EAGAIN || errno==EINTR) ? 0 : -2;
+    // Readable without data: the device has been hung up
+    if (nbRead==0) return (pfd.revents & (POLLHUP | POLLERR)) ? -2 : 0;
+    traceRx(rxBuffer+rxTail,nbRead);
+    rxTail+=nbRead;
+    return nbRead;
+}
+
+
+/*!
+     \brief Copy the bytes already in the internal buffer (Unix only)
+     \param Buffer : destination of the bytes
+     \param MaxNbBytes : maximum number of bytes to copy
+     \return the number of bytes copied
+  */
+unsigned int serialib::drainRxBuffer(void *Buffer,unsigned int MaxNbBytes)
+{
+    unsigned int nbCopy=rxTail-rxHead;
+    if (nbCopy>MaxNbBytes) nbCopy=MaxNbBytes;
+    memcpy(Buffer,rxBuffer+rxHead,nbCopy);
+    rxHead+=nbCopy;
+    return nbCopy;
+}
+#endif
+
+
 /*!
      \brief Read an array of bytes from the serial device (with timeout)
      \param buffer : array of bytes read from the serial device
@@ -684,6 +1017,7 @@ int serialib::readBytes (void *buffer,unsigned int maxNbBytes,unsigned int timeO
 
     // Read the bytes from the serial device, return -2 if an error occured
     if(!ReadFile(hSerial,buffer,(DWORD)maxNbBytes,&dwBytesRead, NULL))  return -2;
+    traceRx(buffer,dwBytesRead);
 
     // Return the byte read
     return dwBytesRead;
@@ -693,7 +1027,9 @@ int serialib::readBytes (void *buffer,unsigned int maxNbBytes,unsigned int timeO
     timeOut          timer;
     // Initialise the timer
     timer.initTimer();
-    unsigned int     NbByteRead=0;
+    // Start with the bytes left over by the previous read operations
+    unsigned int     NbByteRead=drainRxBuffer(buffer,maxNbBytes);
+    if (maxNbBytes>0 && NbByteRead>=maxNbBytes) return NbByteRead;
     // While Timeout is not reached
     while (timer.elapsedTime_ms()<timeOut_ms || timeOut_ms==0)
     {
@@ -707,6 +1043,7 @@ int serialib::readBytes (void *buffer,unsigned int maxNbBytes,unsigned int timeO
         // One or several byte(s) has been read on the device
         if (Ret>0)
         {
+            traceRx(Ptr,Ret);
             // Increase the number of read bytes
             NbByteRead+=Ret;
             // Success : bytes has been read
@@ -724,6 +1061,100 @@ int serialib::readBytes (void *buffer,unsigned int maxNbBytes,unsigned int timeO
 
 
 
+// _______________________________________________________
+// ::: Asynchronous operations (coroutines, scheduler.hpp) :::
+
+
+
+/*!
+     \brief Write an array of data on the current serial port without blocking the thread
+            When the driver buffer is full, the coroutine waits on the Scheduler for the
+            device to be writable.
+     \param Buffer : array of bytes to send on the port, must stay valid until the write is done
+     \param NbBytes : number of byte to send
+     \param deadline : time at which the write is given up
+     \return 1 success
+     \return -1 error while writting data
+     \return -2 deadline reached
+  */
+Task<int> serialib::writeBytesAsync(const void *Buffer, const unsigned int NbBytes, std::chrono::steady_clock::time_point deadline)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    // No readiness notification for the handle: synchronous write
+    UNUSED(deadline);
+    co_return writeBytes(Buffer,NbBytes);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    unsigned int    NbByteWritten=0;
+    while (NbByteWritten<NbBytes)
+    {
+        // Write what the driver accepts
+        ssize_t Ret=write(fd,(const char*)Buffer+NbByteWritten,NbBytes-NbByteWritten);
+        if (Ret>0)
+        {
+            traceTx((const char*)Buffer+NbByteWritten,Ret);
+            NbByteWritten+=Ret;
+            continue;
+        }
+        if (Ret<0 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR) co_return -1;
+
+        // Let the other coroutines run until the device is writable
+        short revents=co_await wait_fd(fd,POLLOUT,deadline);
+        if (revents==0) co_return -2;
+        if (revents & (POLLERR | POLLHUP | POLLNVAL)) co_return -1;
+    }
+    // Write operation successfull
+    co_return 1;
+#endif
+}
+
+
+
+/*!
+     \brief Read an array of bytes from the serial device without blocking the thread
+            While no data is available, the coroutine waits on the Scheduler for the device.
+     \param buffer : array of bytes read from the serial device, must stay valid until the read is done
+     \param maxNbBytes : number of bytes to read
+     \param deadline : time at which the read is given up
+     \return >=0 return the number of bytes read before the deadline or
+                requested data is completed
+     \return -2 error while reading the byte
+  */
+Task<int> serialib::readBytesAsync(void *buffer, unsigned int maxNbBytes, std::chrono::steady_clock::time_point deadline)
+{
+#if defined (_WIN32) || defined(_WIN64)
+    // No readiness notification for the handle: synchronous read
+    long long remaining=std::chrono::duration_cast<std::chrono::milliseconds>(deadline-std::chrono::steady_clock::now()).count();
+    co_return readBytes(buffer,maxNbBytes,remaining>0 ? (unsigned int)remaining : 1);
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    // Start with the bytes left over by the previous read operations
+    unsigned int    NbByteRead=drainRxBuffer(buffer,maxNbBytes);
+    while (NbByteRead<maxNbBytes)
+    {
+        // Read what is available
+        ssize_t Ret=read(fd,(char*)buffer+NbByteRead,maxNbBytes-NbByteRead);
+        if (Ret>0)
+        {
+            traceRx((char*)buffer+NbByteRead,Ret);
+            NbByteRead+=Ret;
+            continue;
+        }
+        if (Ret<0 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR) co_return -2;
+
+        // Let the other coroutines run until data arrives
+        short revents=co_await wait_fd(fd,POLLIN,deadline);
+        // Deadline reached, return the number of bytes read
+        if (revents==0) break;
+        if (!(revents & POLLIN)) co_return -2;
+    }
+    co_return NbByteRead;
+#endif
+}
+
+
+
+
 // _________________________
 // ::: Special operation :::
 
@@ -744,6 +1175,7 @@ char serialib::flushReceiver()
 #if defined (__linux__) || defined(__APPLE__)
     // Purge receiver
     tcflush(fd,TCIFLUSH);
+    rxHead=rxTail=0;
     return true;
 #endif
 }
@@ -770,13 +1202,88 @@ int serialib::available()
     int nBytes=0;
     // Return number of pending bytes in the receiver
     ioctl(fd, FIONREAD, &nBytes);
-    return nBytes;
+    // Bytes already moved to the internal buffer are pending too
+    return nBytes+(rxTail-rxHead);
 #endif
 
 }
 
 
 
+/*!
+    \brief  Use an io_uring engine for the read and write operations (Linux only)
+            The engine can be shared by several serial ports used from the same thread.
+    \param  engine : engine created with serialUring::open, NULL to go back to the classic path
+    \return 1 the engine will be used
+    \return -1 the engine is not available, the classic read/write/poll path is used
+*/
+int serialib::setIoEngine(serialUring *engine)
+{
+#if defined (__linux__)
+    if (engine!=NULL && engine->isAvailable())
+    {
+        ioEngine=engine;
+        return 1;
+    }
+    ioEngine=NULL;
+    return -1;
+#else
+    UNUSED(engine);
+    return -1;
+#endif
+}
+
+
+
+/*!
+    \brief  Return the file descriptor of the device, to queue requests directly on an engine
+    \return The file descriptor, -1 if the device is closed or on Windows
+*/
+int serialib::getFileDescriptor()
+{
+#if defined (_WIN32) || defined(_WIN64)
+    return -1;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    return fd;
+#endif
+}
+
+
+
+/*!
+    \brief  Record every byte sent and received on this port in a trace log
+    \param  tracer : open trace log, NULL to disable tracing
+    \param  portId : id of this port in the log
+*/
+void serialib::setTracer(serialTracer *tracer, uint16_t portId)
+{
+    this->tracer=tracer;
+    this->tracePort=portId;
+}
+
+
+
+/*!
+    \brief  Record bytes written to the device (no-op if tracing is disabled)
+*/
+void serialib::traceTx(const void *Buffer,size_t NbBytes)
+{
+    if (tracer!=NULL && NbBytes>0) tracer->record(tracePort,SERIAL_TRACE_TX,Buffer,NbBytes);
+}
+
+
+
+/*!
+    \brief  Record bytes read from the device (no-op if tracing is disabled)
+*/
+void serialib::traceRx(const void *Buffer,size_t NbBytes)
+{
+    if (tracer!=NULL && NbBytes>0) tracer->record(tracePort,SERIAL_TRACE_RX,Buffer,NbBytes);
+}
+
+
+
 // __________________
 // ::: I/O Access :::
 
@@ -814,11 +1321,11 @@ bool serialib::setDTR()
     return EscapeCommFunction(hSerial,SETDTR);
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Set DTR
-    int status_DTR=0;
-    ioctl(fd, TIOCMGET, &status_DTR);
-    status_DTR |= TIOCM_DTR;
-    ioctl(fd, TIOCMSET, &status_DTR);
+    // Set DTR in a single ioctl, without reading the other bits back
+    int bits=TIOCM_DTR;
+    if (ioctl(fd, TIOCMBIS, &bits)!=0) return false;
+    modemControl |= TIOCM_DTR;
+    currentStateDTR=true;
     return true;
 #endif
 }
@@ -837,11 +1344,11 @@ bool serialib::clearDTR()
     return EscapeCommFunction(hSerial,CLRDTR);
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Clear DTR
-    int status_DTR=0;
-    ioctl(fd, TIOCMGET, &status_DTR);
-    status_DTR &= ~TIOCM_DTR;
-    ioctl(fd, TIOCMSET, &status_DTR);
+    // Clear DTR in a single ioctl, without reading the other bits back
+    int bits=TIOCM_DTR;
+    if (ioctl(fd, TIOCMBIC, &bits)!=0) return false;
+    modemControl &= ~TIOCM_DTR;
+    currentStateDTR=false;
     return true;
 #endif
 }
@@ -882,11 +1389,11 @@ bool serialib::setRTS()
     return EscapeCommFunction(hSerial,SETRTS);
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Set RTS
-    int status_RTS=0;
-    ioctl(fd, TIOCMGET, &status_RTS);
-    status_RTS |= TIOCM_RTS;
-    ioctl(fd, TIOCMSET, &status_RTS);
+    // Set RTS in a single ioctl, without reading the other bits back
+    int bits=TIOCM_RTS;
+    if (ioctl(fd, TIOCMBIS, &bits)!=0) return false;
+    modemControl |= TIOCM_RTS;
+    currentStateRTS=true;
     return true;
 #endif
 }
@@ -907,11 +1414,46 @@ bool serialib::clearRTS()
     return EscapeCommFunction(hSerial,CLRRTS);
 #endif
 #if defined (__linux__) || defined(__APPLE__)
-    // Clear RTS
-    int status_RTS=0;
-    ioctl(fd, TIOCMGET, &status_RTS);
-    status_RTS &= ~TIOCM_RTS;
-    ioctl(fd, TIOCMSET, &status_RTS);
+    // Clear RTS in a single ioctl, without reading the other bits back
+    int bits=TIOCM_RTS;
+    if (ioctl(fd, TIOCMBIC, &bits)!=0) return false;
+    modemControl &= ~TIOCM_RTS;
+    currentStateRTS=false;
+    return true;
+#endif
+}
+
+
+
+/*!
+    \brief      Set DTR (pin 4) and RTS (pin 7) in a single operation, so that both lines
+                change at the same time and a pulse costs one system call per edge
+    \param      Lines : the new state of the lines, a combination of SERIAL_LINE_DTR and SERIAL_LINE_RTS
+    \param      Mask : the lines to update, the others keep their state
+    \return     If the function fails, the return value is false
+                If the function succeeds, the return value is true.
+*/
+bool serialib::setLines(int Lines, int Mask)
+{
+    bool dtr = (Mask & SERIAL_LINE_DTR) ? (Lines & SERIAL_LINE_DTR) : currentStateDTR;
+    bool rts = (Mask & SERIAL_LINE_RTS) ? (Lines & SERIAL_LINE_RTS) : currentStateRTS;
+#if defined (_WIN32) || defined(_WIN64)
+    // Windows changes one line per call
+    if (!EscapeCommFunction(hSerial, dtr ? SETDTR : CLRDTR)) return false;
+    currentStateDTR=dtr;
+    if (!EscapeCommFunction(hSerial, rts ? SETRTS : CLRRTS)) return false;
+    currentStateRTS=rts;
+    return true;
+#endif
+#if defined (__linux__) || defined(__APPLE__)
+    // Both lines in one TIOCMSET, from the bits kept since the device was opened
+    int bits = modemControl & ~(TIOCM_DTR | TIOCM_RTS);
+    if (dtr) bits |= TIOCM_DTR;
+    if (rts) bits |= TIOCM_RTS;
+    if (ioctl(fd, TIOCMSET, &bits)!=0) return false;
+    modemControl=bits;
+    currentStateDTR=dtr;
+    currentStateRTS=rts;
     return true;
 #endif
 }
@@ -0,0 +1,444 @@
+/*!
+ \file    serialmodem.cpp
+ \brief   Source file of the classes serialModemMonitor and serialLineSequence, which watch the
+          modem input lines of a serial port and play timed changes of its output lines.
+ */
+
+#include "serialmodem.hpp"
+#include "serialib.hpp"
+#include "deadline.hpp"
+#include <algorithm>
+#include <chrono>
+#include <signal.h>
+
+#if defined (__linux__)
+    #include <linux/serial.h>
+    #include <pthread.h>
+    #include <sys/eventfd.h>
+#endif
+
+
+
+//_____________________________________
+// ::: Constructors and destructors :::
+
+
+/*!
+    \brief      Constructor of the class serialModemMonitor. Nothing is watched until start is called.
+*/
+serialModemMonitor::serialModemMonitor()
+{
+    fd = -1;
+    eventFd = -1;
+    lines = 0;
+    running = false;
+    stopping = false;
+    missedEdges = 0;
+    droppedEvents = 0;
+}
+
+
+/*!
+    \brief      Destructor of the class serialModemMonitor. It stops the helper thread
+*/
+serialModemMonitor::~serialModemMonitor()
+{
+    stop();
+#if defined (__linux__)
+    if (eventFd>=0) ::close(eventFd);
+#endif
+}
+
+
+
+//_________________________________________
+// ::: Configuration and initialization :::
+
+
+#if defined (__linux__)
+// The wake-up signal only has to interrupt the ioctl of the helper thread
+static void wakeHandler(int)
+{
+}
+
+
+// Install the wake-up handler, without SA_RESTART so that TIOCMIWAIT fails with EINTR.
+// A handler installed by the application is kept, unless it restarts the interrupted calls:
+// the helper thread could then not be woken up.
+// Returns 1 on success, -1 if the handler of the application has SA_RESTART
+static int installWakeHandler()
+{
+    struct sigaction current;
+    if (sigaction(SERIALMODEM_WAKE_SIGNAL,NULL,&current)!=0) return -1;
+    if (current.sa_handler!=SIG_DFL && current.sa_handler!=SIG_IGN)
+        return (current.sa_flags & SA_RESTART) ? -1 : 1;
+    struct sigaction action = {};
+    action.sa_handler=wakeHandler;
+    sigemptyset(&action.sa_mask);
+    return sigaction(SERIALMODEM_WAKE_SIGNAL,&action,NULL)==0 ? 1 : -1;
+}
+#endif
+
+
+/*!
+     \brief Start a helper thread reporting the edges of modem lines. The port must stay open
+            until the monitor is stopped.
+            Without a callback the events are queued for nextEvent, and getEventFd becomes
+            readable, so that an event loop can wait for them (wait_fd in scheduler.hpp).
+     \param Port : an open serial port
+     \param Lines : the lines to watch, a combination of SERIAL_MODEM_CTS, SERIAL_MODEM_DSR,
+                    SERIAL_MODEM_DCD and SERIAL_MODEM_RI
+     \param Callback : called on the helper thread for each event, nullptr to queue the events
+     \return 1 success
+     \return -1 the port is not open, no line is given or the monitor is running
+     \return -2 the driver of the port does not count the modem line edges
+     \return -3 the helper thread could not be started (or not supported on this platform)
+     \return -4 the application handles SERIALMODEM_WAKE_SIGNAL with SA_RESTART, the helper
+                thread could not be stopped
+  */
+int serialModemMonitor::start(serialib *Port,int Lines,serialModemCallback Callback)
+{
+#if defined (__linux__)
+    Lines&=SERIAL_MODEM_CTS | SERIAL_MODEM_DSR | SERIAL_MODEM_DCD | SERIAL_MODEM_RI;
+    if (Port==NULL || Port->getFileDescriptor()<0 || Lines==0 || running.load()) return -1;
+    if (thread.joinable()) thread.join();
+    struct serial_icounter_struct counters;
+    if (ioctl(Port->getFileDescriptor(),TIOCGICOUNT,&counters)!=0) return -2;
+    if (eventFd<0) eventFd=eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd<0) return -3;
+    if (installWakeHandler()!=1) return -4;
+    fd=Port->getFileDescriptor();
+    lines=Lines;
+    callback=Callback;
+    stopping=false;
+    running=true;
+    try
+    {
+        thread=std::thread(&serialModemMonitor::run,this);
+    }
+    catch (const std::system_error&)
+    {
+        running=false;
+        return -3;
+    }
+    return 1;
+#else
+    UNUSED(Port);
+    UNUSED(Lines);
+    UNUSED(Callback);
+    return -3;
+#endif
+}
+
+
+/*!
+     \brief Stop the helper thread. The queued events can still be read.
+*/
+void serialModemMonitor::stop()
+{
+#if defined (__linux__)
+    if (!thread.joinable()) return;
+    stopping=true;
+    // The signal is lost if it arrives before the thread enters the ioctl: repeat it
+    while (running.load())
+    {
+        pthread_kill(thread.native_handle(),SERIALMODEM_WAKE_SIGNAL);
+        for (int i=0;i<100 && running.load();i++)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    thread.join();
+#endif
+}
+
+
+/*!
+     \brief Check if the helper thread is running. It stops on its own if the port is closed.
+     \return true if the lines are watched
+*/
+bool serialModemMonitor::isRunning()
+{
+    return running.load();
+}
+
+
+
+//______________
+// ::: Events :::
+
+
+/*!
+     \brief Return a file descriptor readable when events are queued for nextEvent.
+            It stays valid for the life of the monitor.
+     \return the file descriptor, -1 if the monitor was never started (or on other platforms)
+*/
+int serialModemMonitor::getEventFd()
+{
+    return eventFd;
+}
+
+
+/*!
+     \brief Read the next queued event, from one thread at a time
+     \param Event : receives the event
+     \return 1 an event is returned
+     \return 0 no event is queued
+*/
+int serialModemMonitor::nextEvent(serialModemEvent *Event)
+{
+    if (events.pop(*Event)) return 1;
+#if defined (__linux__)
+    // Clear the descriptor, then look again for an event queued meanwhile
+    uint64_t count;
+    if (eventFd>=0 && read(eventFd,&count,sizeof(count))==sizeof(count) && events.pop(*Event)) return 1;
+#endif
+    return 0;
+}
+
+
+/*!
+     \brief Return the number of edges which happened too close to the previous one to be seen
+            one by one: they are included in the edges field of the events
+     \return the number of missed edges since the construction of the monitor
+*/
+uint64_t serialModemMonitor::getMissedEdges()
+{
+    return missedEdges.load(std::memory_order_relaxed);
+}
+
+
+/*!
+     \brief Return the number of events dropped because nextEvent was not called often enough
+     \return the number of dropped events since the construction of the monitor
+*/
+uint64_t serialModemMonitor::getDroppedEvents()
+{
+    return droppedEvents.load(std::memory_order_relaxed);
+}
+
+
+/*!
+     \brief Hand an event to the callback or to the queue
+     \param Event : the event
+*/
+void serialModemMonitor::deliver(const serialModemEvent &Event)
+{
+    if (callback)
+    {
+        callback(Event);
+        return;
+    }
+    if (!events.push(Event))
+    {
+        droppedEvents.fetch_add(1,std::memory_order_relaxed);
+        return;
+    }
+#if defined (__linux__)
+    uint64_t one=1;
+    if (write(eventFd,&one,sizeof(one))<0) {}
+#endif
+}
+
+
+/*!
+     \brief Body of the helper thread: sleep in the driver until a watched line changes, then
+            compare the interrupt counters to report the edges of each line
+*/
+void serialModemMonitor::run()
+{
+#if defined (__linux__)
+    static const struct { int line; int bit; } map[]={
+        {SERIAL_MODEM_CTS,TIOCM_CTS},{SERIAL_MODEM_DSR,TIOCM_DSR},
+        {SERIAL_MODEM_DCD,TIOCM_CD},{SERIAL_MODEM_RI,TIOCM_RNG}};
+    int waitMask=0;
+    for (const auto &m : map)
+        if (lines & m.line) waitMask|=m.bit;
+
+    struct serial_icounter_struct before,after;
+    bool ok=ioctl(fd,TIOCGICOUNT,&before)==0;
+    while (ok && !stopping.load())
+    {
+        if (ioctl(fd,TIOCMIWAIT,waitMask)!=0)
+        {
+            if (errno==EINTR) continue;
+            break; // Port closed or device unplugged
+        }
+        // Edges arriving while the events are delivered are picked up without waiting
+        for (;;)
+        {
+            uint64_t timestamp=std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+            int status=0;
+            if (ioctl(fd,TIOCGICOUNT,&after)!=0 || ioctl(fd,TIOCMGET,&status)!=0)
+            {
+                ok=false;
+                break;
+            }
+            int counts[][2]={{before.cts,after.cts},{before.dsr,after.dsr},
+                             {before.dcd,after.dcd},{before.rng,after.rng}};
+            bool changed=false;
+            for (int i=0;i<4;i++)
+            {
+                uint32_t edges=(uint32_t)(counts[i][1]-counts[i][0]);
+                if (!(lines & map[i].line) || edges==0) continue;
+                serialModemEvent event;
+                event.timestamp_ns=timestamp;
+                event.edges=edges;
+                event.line=map[i].line;
+                event.level=(status & map[i].bit) ? 1 : 0;
+                if (edges>1) missedEdges.fetch_add(edges-1,std::memory_order_relaxed);
+                deliver(event);
+                changed=true;
+            }
+            before=after;
+            if (!changed) break;
+        }
+    }
+#endif
+    running=false;
+}
+
+
+
+// ******************************************
+//  Class serialLineSequence
+// ******************************************
+
+
+/*!
+    \brief      Constructor of the class serialLineSequence. The sequence is empty.
+*/
+serialLineSequence::serialLineSequence()
+{
+    sorted = true;
+    spinUs = 0;
+    maxLateness = 0;
+}
+
+
+/*!
+     \brief Remove every step of the sequence
+*/
+void serialLineSequence::clear()
+{
+    steps.clear();
+    sorted = true;
+}
+
+
+/*!
+     \brief Change lines at a given time. Steps can be added in any order, the steps at the
+            same offset are played in the order they were added.
+     \param Offset_us : time of the change from the start of the sequence, in microseconds
+     \param Lines : the new state of the lines, a combination of SERIAL_LINE_DTR and SERIAL_LINE_RTS
+     \param Mask : the lines to change
+*/
+void serialLineSequence::set(uint64_t Offset_us,int Lines,int Mask)
+{
+    serialLineStep step;
+    step.offset_ns=Offset_us*1000;
+    step.lines=Lines & Mask;
+    step.mask=Mask & (SERIAL_LINE_DTR | SERIAL_LINE_RTS);
+    if (!steps.empty() && step.offset_ns<steps.back().offset_ns) sorted=false;
+    steps.push_back(step);
+}
+
+
+/*!
+     \brief Add a pulse on one line: the line is set to its active level, then back
+     \param Line : SERIAL_LINE_DTR or SERIAL_LINE_RTS
+     \param Start_us : start of the pulse from the start of the sequence, in microseconds
+     \param Width_us : duration of the pulse, in microseconds
+     \param Active : true for a high pulse, false for a low pulse
+*/
+void serialLineSequence::pulse(int Line,uint64_t Start_us,uint64_t Width_us,bool Active)
+{
+    set(Start_us,Active ? Line : 0,Line);
+    set(Start_us+Width_us,Active ? 0 : Line,Line);
+}
+
+
+/*!
+     \brief Add a train of pulses on one line
+     \param Line : SERIAL_LINE_DTR or SERIAL_LINE_RTS
+     \param Start_us : start of the first pulse from the start of the sequence, in microseconds
+     \param Width_us : duration of each pulse, in microseconds
+     \param Period_us : time between the starts of two pulses, in microseconds
+     \param Count : number of pulses
+     \param Active : true for high pulses, false for low pulses
+*/
+void serialLineSequence::train(int Line,uint64_t Start_us,uint64_t Width_us,uint64_t Period_us,unsigned int Count,bool Active)
+{
+    for (unsigned int i=0;i<Count;i++)
+        pulse(Line,Start_us+i*Period_us,Width_us,Active);
+}
+
+
+/*!
+     \brief Play the sequence from now, see play(Port,Start)
+*/
+int serialLineSequence::play(serialib *Port)
+{
+    return play(Port,std::chrono::steady_clock::now());
+}
+
+
+/*!
+     \brief Play the sequence, blocking the calling thread until the last step.
+            Each step waits for its absolute deadline, Start plus its offset, with sleepUntil
+            (deadline.hpp), so that late wake-ups do not add up along the sequence.
+            Steps whose deadline has passed are played at once.
+     \param Port : an open serial port
+     \param Start : time of the offset 0 (steady clock)
+     \return 1 success
+     \return -1 the port is not open
+     \return -2 error while changing the lines, the sequence is stopped
+*/
+int serialLineSequence::play(serialib *Port,std::chrono::steady_clock::time_point Start)
+{
+    if (Port==NULL || !Port->isDeviceOpen()) return -1;
+    if (!sorted)
+    {
+        std::stable_sort(steps.begin(),steps.end(),
+            [](const serialLineStep &a,const serialLineStep &b) { return a.offset_ns<b.offset_ns; });
+        sorted=true;
+    }
+    maxLateness=0;
+    size_t i=0;
+    while (i<steps.size())
+    {
+        // Merge the steps at the same offset into one update of the lines
+        uint64_t offset=steps[i].offset_ns;
+        int lines=0,mask=0;
+        for (;i<steps.size() && steps[i].offset_ns==offset;i++)
+        {
+            lines=(lines & ~steps[i].mask) | steps[i].lines;
+            mask|=steps[i].mask;
+        }
+        int64_t late=sleepUntil(Start+std::chrono::nanoseconds(offset),spinUs);
+        maxLateness=std::max<uint64_t>(maxLateness,late);
+        if (!Port->setLines(lines,mask)) return -2;
+    }
+    return 1;
+}
+
+
+/*!
+     \brief Spin on the clock for the last microseconds before each step, instead of sleeping,
+            for a jitter of about a microsecond at the cost of that CPU time
+     \param Spin_us : the spin time in microseconds, 0 to sleep until the deadline
+*/
+void serialLineSequence::setSpin(unsigned int Spin_us)
+{
+    spinUs=Spin_us;
+}
+
+
+/*!
+     \brief Return the largest delay between the deadline of a step and the update of its
+            lines during the last play, the scheduling jitter of the sequence
+     \return the delay in nanoseconds
+*/
+uint64_t serialLineSequence::getMaxLateness()
+{
+    return maxLateness;
+}
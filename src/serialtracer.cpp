@@ -0,0 +1,285 @@
+/*!
+ \file    serialtracer.cpp
+ \brief   Source file of the class serialTracer. This class records the bytes sent and received
+          by serial ports in a memory-mapped binary log.
+ */
+
+#include "serialtracer.hpp"
+#include "serialib.hpp"
+#include <chrono>
+
+#if defined (__linux__) || defined(__APPLE__)
+    #include <sys/mman.h>
+#endif
+
+static_assert(sizeof(serialTraceHeader)==64,"unexpected trace header size");
+static_assert(sizeof(serialTraceRecord)==32,"unexpected trace record size");
+
+
+
+//_____________________________________
+// ::: Constructors and destructors :::
+
+
+/*!
+    \brief      Constructor of the class serialTracer. Nothing is recorded until open is called.
+*/
+serialTracer::serialTracer()
+{
+    header = NULL;
+    records = NULL;
+    mask = 0;
+    mapSize = 0;
+}
+
+
+/*!
+    \brief      Destructor of the class serialTracer. It closes the log
+*/
+serialTracer::~serialTracer()
+{
+    close();
+}
+
+
+
+//_________________________________________
+// ::: Configuration and initialization :::
+
+
+/*!
+     \brief Create the log file, preallocate it and map it in memory
+     \param Path : path of the log file (truncated if it exists)
+     \param recordCount : number of records kept, rounded up to a power of two
+     \return 1 success
+     \return -1 error while creating the file
+     \return -2 error while allocating the file
+     \return -3 error while mapping the file (or not supported on this platform)
+  */
+int serialTracer::open(const char *Path,unsigned int recordCount)
+{
+#if defined (__linux__) || defined(__APPLE__)
+    close();
+
+    // Round up to a power of two so that the ring index is a mask
+    uint64_t count=1;
+    while (count<recordCount) count<<=1;
+
+    int fd=::open(Path,O_RDWR | O_CREAT | O_TRUNC,0644);
+    if (fd<0) return -1;
+    size_t size=sizeof(serialTraceHeader)+count*sizeof(serialTraceRecord);
+    if (ftruncate(fd,size)!=0)
+    {
+        ::close(fd);
+        return -2;
+    }
+    void *map=mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,0);
+    // The mapping keeps the file alive
+    ::close(fd);
+    if (map==MAP_FAILED) return -3;
+
+    mapSize=size;
+    header=(serialTraceHeader*)map;
+    records=(serialTraceRecord*)((char*)map+sizeof(serialTraceHeader));
+    mask=count-1;
+    memcpy(header->magic,SERIALTRACE_MAGIC,sizeof(header->magic));
+    header->recordSize=sizeof(serialTraceRecord);
+    header->recordCount=count;
+    header->nextSequence.store(0,std::memory_order_release);
+    return 1;
+#else
+    UNUSED(Path);
+    UNUSED(recordCount);
+    return -3;
+#endif
+}
+
+
+/*!
+     \brief Unmap the log file. The records stay in the file.
+            No record must be in progress when the log is closed.
+*/
+void serialTracer::close()
+{
+#if defined (__linux__) || defined(__APPLE__)
+    if (header!=NULL) munmap(header,mapSize);
+#endif
+    header=NULL;
+    records=NULL;
+    mask=0;
+    mapSize=0;
+}
+
+
+/*!
+     \brief Check if the log is open
+     \return true if the records are written to a file
+*/
+bool serialTracer::isOpen()
+{
+    return header!=NULL;
+}
+
+
+
+//_________________
+// ::: Recording :::
+
+
+/*!
+     \brief Append a run of bytes to the log. Can be called from several threads at once.
+     \param port : id of the serial port
+     \param direction : SERIAL_TRACE_TX or SERIAL_TRACE_RX
+     \param Buffer : bytes sent or received
+     \param NbBytes : number of bytes
+  */
+void serialTracer::record(uint16_t port,SerialTraceDirection direction,const void *Buffer,unsigned int NbBytes)
+{
+    if (header==NULL) return;
+    uint64_t timestamp=std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    const char *data=(const char*)Buffer;
+
+    do
+    {
+        unsigned int length=(NbBytes<SERIALTRACE_RECORD_DATA) ? NbBytes : SERIALTRACE_RECORD_DATA;
+        uint64_t sequence=header->nextSequence.fetch_add(1,std::memory_order_relaxed);
+        serialTraceRecord *rec=&records[sequence & mask];
+
+        // Readers skip the record while it is written
+        rec->sequence.store(0,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        rec->timestamp_ns=timestamp;
+        rec->port=port;
+        rec->direction=direction;
+        rec->length=length;
+        memcpy(rec->data,data,length);
+        rec->sequence.store(sequence+1,std::memory_order_release);
+
+        data+=length;
+        NbBytes-=length;
+    } while (NbBytes>0);
+}
+
+
+
+// ******************************************
+//  Class serialTraceReader
+// ******************************************
+
+
+/*!
+    \brief      Constructor of the class serialTraceReader.
+*/
+serialTraceReader::serialTraceReader()
+{
+    header = NULL;
+    records = NULL;
+    mask = 0;
+    mapSize = 0;
+    sequence = 0;
+    lastSequence = 0;
+}
+
+
+/*!
+    \brief      Destructor of the class serialTraceReader. It closes the file
+*/
+serialTraceReader::~serialTraceReader()
+{
+    close();
+}
+
+
+/*!
+     \brief Open a trace file. The file can still be written by a serialTracer:
+            the records appended after open are not returned.
+     \param Path : path of the trace file
+     \return 1 success
+     \return -1 error while opening the file
+     \return -2 the file is not a trace file
+     \return -3 error while mapping the file (or not supported on this platform)
+  */
+int serialTraceReader::open(const char *Path)
+{
+#if defined (__linux__) || defined(__APPLE__)
+    close();
+
+    int fd=::open(Path,O_RDONLY);
+    if (fd<0) return -1;
+    off_t size=lseek(fd,0,SEEK_END);
+    if (size<(off_t)sizeof(serialTraceHeader))
+    {
+        ::close(fd);
+        return -2;
+    }
+    void *map=mmap(NULL,size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if (map==MAP_FAILED) return -3;
+    mapSize=size;
+    header=(serialTraceHeader*)map;
+
+    // Check the format
+    uint64_t count=header->recordCount;
+    if (memcmp(header->magic,SERIALTRACE_MAGIC,sizeof(header->magic))!=0
+        || header->recordSize!=sizeof(serialTraceRecord)
+        || count==0 || (count & (count-1))!=0
+        || sizeof(serialTraceHeader)+count*sizeof(serialTraceRecord)>mapSize)
+    {
+        close();
+        return -2;
+    }
+    records=(serialTraceRecord*)((char*)map+sizeof(serialTraceHeader));
+    mask=count-1;
+
+    // Oldest record still in the ring
+    lastSequence=header->nextSequence.load(std::memory_order_acquire);
+    sequence=(lastSequence>count) ? lastSequence-count : 0;
+    return 1;
+#else
+    UNUSED(Path);
+    return -3;
+#endif
+}
+
+
+/*!
+     \brief Close the trace file
+*/
+void serialTraceReader::close()
+{
+#if defined (__linux__) || defined(__APPLE__)
+    if (header!=NULL) munmap(header,mapSize);
+#endif
+    header=NULL;
+    records=NULL;
+}
+
+
+/*!
+     \brief Read the next record. Records being written or overwritten are skipped.
+     \param event : receives the record
+     \return 1 a record has been read
+     \return 0 no more record
+  */
+int serialTraceReader::next(serialTraceEvent *event)
+{
+    while (header!=NULL && sequence<lastSequence)
+    {
+        const serialTraceRecord *rec=&records[sequence & mask];
+        uint64_t current=sequence++;
+        if (rec->sequence.load(std::memory_order_acquire)!=current+1) continue;
+        event->sequence=current;
+        event->timestamp_ns=rec->timestamp_ns;
+        event->port=rec->port;
+        event->direction=rec->direction;
+        event->length=rec->length;
+        memcpy(event->data,rec->data,SERIALTRACE_RECORD_DATA);
+        // The record has been overwritten while it was copied
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (rec->sequence.load(std::memory_order_relaxed)!=current+1) continue;
+        if (event->length>SERIALTRACE_RECORD_DATA) continue;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,447 @@
+/*!
+ \file    serialuring.cpp
+ \brief   Source file of the class serialUring. This class is an optional io_uring based I/O engine
+          for serialib (Linux only).
+
+The ring is driven with the raw io_uring_setup/io_uring_enter system calls, no external library
+is needed. Every request can be followed by a linked timeout; the completion of the timeout
+itself is consumed by the engine and never returned to the caller.
+ */
+
+#include "serialuring.hpp"
+
+#if defined (__linux__)
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <poll.h>
+#endif
+
+
+
+//_____________________________________
+// ::: Constructors and destructors :::
+
+
+/*!
+    \brief      Constructor of the class serialUring. The ring is not created until open is called.
+*/
+serialUring::serialUring()
+{
+    ringFd = -1;
+    entries = 0;
+    sqRing = NULL;
+    sqRingSize = 0;
+    sqHead = sqTail = sqMask = sqArray = NULL;
+    sqes = NULL;
+    sqesSize = 0;
+    sqLocalTail = 0;
+    sqPending = 0;
+    cqRing = NULL;
+    cqRingSize = 0;
+    cqHead = cqTail = cqMask = NULL;
+    cqes = NULL;
+    timeouts = NULL;
+    stash = NULL;
+    stashCount = 0;
+    inFlight = 0;
+    enterCount = 0;
+}
+
+
+/*!
+    \brief      Destructor of the class serialUring. It releases the ring
+*/
+serialUring::~serialUring()
+{
+    close();
+}
+
+
+
+//_________________________________________
+// ::: Configuration and initialization :::
+
+
+/*!
+     \brief Create the ring
+     \param entries : number of submission entries (rounded up to a power of two by the kernel)
+            A write uses two entries, a read uses three
+     \return 1 success
+     \return -1 io_uring is not supported by the kernel (or disabled)
+     \return -2 error while mapping the rings
+  */
+int serialUring::open(unsigned int entries)
+{
+#if defined (__linux__)
+    close();
+
+    struct io_uring_params params;
+    memset(&params,0,sizeof(params));
+    int fd=syscall(__NR_io_uring_setup,entries,&params);
+    // ENOSYS, EPERM (disabled by sysctl or seccomp)...
+    if (fd<0) return -1;
+    ringFd=fd;
+    this->entries=params.sq_entries;
+
+    // Map the submission and completion rings
+    sqRingSize=params.sq_off.array+params.sq_entries*sizeof(unsigned int);
+    cqRingSize=params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cqRingSize>sqRingSize) sqRingSize=cqRingSize;
+        cqRingSize=sqRingSize;
+    }
+    sqRing=mmap(NULL,sqRingSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ringFd,IORING_OFF_SQ_RING);
+    if (sqRing==MAP_FAILED) { sqRing=NULL; close(); return -2; }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cqRing=sqRing;
+    else
+    {
+        cqRing=mmap(NULL,cqRingSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ringFd,IORING_OFF_CQ_RING);
+        if (cqRing==MAP_FAILED) { cqRing=NULL; close(); return -2; }
+    }
+    sqesSize=params.sq_entries*sizeof(struct io_uring_sqe);
+    sqes=mmap(NULL,sqesSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,ringFd,IORING_OFF_SQES);
+    if (sqes==MAP_FAILED) { sqes=NULL; close(); return -2; }
+
+    sqHead=(unsigned int*)((char*)sqRing+params.sq_off.head);
+    sqTail=(unsigned int*)((char*)sqRing+params.sq_off.tail);
+    sqMask=(unsigned int*)((char*)sqRing+params.sq_off.ring_mask);
+    sqArray=(unsigned int*)((char*)sqRing+params.sq_off.array);
+    cqHead=(unsigned int*)((char*)cqRing+params.cq_off.head);
+    cqTail=(unsigned int*)((char*)cqRing+params.cq_off.tail);
+    cqMask=(unsigned int*)((char*)cqRing+params.cq_off.ring_mask);
+    cqes=(char*)cqRing+params.cq_off.cqes;
+    sqLocalTail=*sqTail;
+
+    // Everything the hot path needs is allocated here
+    timeouts=new struct __kernel_timespec[this->entries];
+    stash=new serialCompletion[this->entries];
+    return 1;
+#else
+    UNUSED(entries);
+    return -1;
+#endif
+}
+
+
+/*!
+     \brief Release the ring. Requests still in flight are abandoned.
+*/
+void serialUring::close()
+{
+#if defined (__linux__)
+    if (sqes!=NULL) munmap(sqes,sqesSize);
+    if (cqRing!=NULL && cqRing!=sqRing) munmap(cqRing,cqRingSize);
+    if (sqRing!=NULL) munmap(sqRing,sqRingSize);
+    if (ringFd>=0) ::close(ringFd);
+    delete[] (struct __kernel_timespec*)timeouts;
+#endif
+    delete[] stash;
+    ringFd=-1;
+    sqRing=cqRing=sqes=timeouts=NULL;
+    stash=NULL;
+    stashCount=0;
+    inFlight=0;
+    sqPending=0;
+}
+
+
+/*!
+     \brief Check if the ring has been created
+     \return true if requests can be queued
+*/
+bool serialUring::isAvailable()
+{
+    return ringFd>=0;
+}
+
+
+
+//______________________
+// ::: I/O requests :::
+
+
+/*!
+     \brief Queue a write request. The request is submitted by the next call to wait or waitFor.
+            The data and the iovec array must stay valid until the request is completed.
+     \param fd : file descriptor of the serial device
+     \param Iov : arrays of bytes to send
+     \param IovCount : number of arrays
+     \param timeOut_ms : the request is cancelled after this delay, 0 to disable the timeout
+     \param tag : value returned with the completion
+     \return 1 success
+     \return -1 the ring is not available or full
+  */
+int serialUring::queueWrite(int fd,const struct iovec *Iov,int IovCount,unsigned int timeOut_ms,uint64_t tag)
+{
+#if defined (__linux__)
+    // The write and its timeout
+    if (!hasRoom(2)) return -1;
+    struct io_uring_sqe *sqe=(struct io_uring_sqe*)nextSqe();
+    sqe->opcode=IORING_OP_WRITEV;
+    sqe->fd=fd;
+    sqe->off=(uint64_t)-1;
+    sqe->addr=(uint64_t)(uintptr_t)Iov;
+    sqe->len=IovCount;
+    sqe->user_data=tag & ~SERIALURING_TAG_RESERVED;
+    linkTimeout(sqe,timeOut_ms);
+    inFlight++;
+    return 1;
+#else
+    UNUSED(fd); UNUSED(Iov); UNUSED(IovCount); UNUSED(timeOut_ms); UNUSED(tag);
+    return -1;
+#endif
+}
+
+
+/*!
+     \brief Queue a read request. The request is submitted by the next call to wait or waitFor.
+            It completes as soon as at least one byte is available.
+     \param fd : file descriptor of the serial device
+     \param Buffer : destination of the bytes, must stay valid until the request is completed
+     \param MaxNbBytes : maximum number of bytes read
+     \param timeOut_ms : the request is cancelled after this delay, 0 to disable the timeout
+     \param tag : value returned with the completion
+     \return 1 success
+     \return -1 the ring is not available or full
+  */
+int serialUring::queueRead(int fd,void *Buffer,unsigned int MaxNbBytes,unsigned int timeOut_ms,uint64_t tag)
+{
+#if defined (__linux__)
+    // With VMIN=0 a read on the device returns 0 at once when there is no data,
+    // so the read is chained after a poll which carries the timeout
+    if (!hasRoom(3)) return -1;
+    struct io_uring_sqe *pollSqe=(struct io_uring_sqe*)nextSqe();
+    pollSqe->opcode=IORING_OP_POLL_ADD;
+    pollSqe->fd=fd;
+    pollSqe->poll32_events=POLLIN;
+    pollSqe->flags=IOSQE_IO_LINK;
+    pollSqe->user_data=SERIALURING_TAG_RESERVED;
+    struct io_uring_sqe *timeoutSqe=(struct io_uring_sqe*)linkTimeout(pollSqe,timeOut_ms);
+    if (timeoutSqe!=NULL) timeoutSqe->flags|=IOSQE_IO_LINK;
+
+    struct io_uring_sqe *sqe=(struct io_uring_sqe*)nextSqe();
+    sqe->opcode=IORING_OP_READ;
+    sqe->fd=fd;
+    sqe->off=(uint64_t)-1;
+    sqe->addr=(uint64_t)(uintptr_t)Buffer;
+    sqe->len=MaxNbBytes;
+    sqe->user_data=tag & ~SERIALURING_TAG_RESERVED;
+    inFlight++;
+    return 1;
+#else
+    UNUSED(fd); UNUSED(Buffer); UNUSED(MaxNbBytes); UNUSED(timeOut_ms); UNUSED(tag);
+    return -1;
+#endif
+}
+
+
+/*!
+     \brief Submit the queued requests and collect the completed ones.
+            Submission and waiting are done with a single system call when possible.
+     \param completions : array filled with the completed requests
+     \param maxNb : size of the array
+     \param minNb : minimum number of completions to wait for (bounded by the requests in flight)
+     \return >=0 number of completions written in the array
+     \return -1 error while entering the ring
+  */
+int serialUring::wait(serialCompletion *completions,unsigned int maxNb,unsigned int minNb)
+{
+    if (!isAvailable()) return -1;
+    if (minNb>maxNb) minNb=maxNb;
+    if (minNb>inFlight+stashCount) minNb=inFlight+stashCount;
+
+    reap();
+    while (sqPending>0 || stashCount<minNb)
+    {
+        if (enter(sqPending,stashCount<minNb ? 1 : 0)<0) return -1;
+        reap();
+    }
+
+    // Hand over the oldest completions
+    unsigned int nb=(stashCount<maxNb) ? stashCount : maxNb;
+    memcpy(completions,stash,nb*sizeof(serialCompletion));
+    memmove(stash,stash+nb,(stashCount-nb)*sizeof(serialCompletion));
+    stashCount-=nb;
+    return nb;
+}
+
+
+/*!
+     \brief Submit the queued requests and wait for the completion of the request with the given tag.
+            Completions of other requests are kept for the next calls to wait or waitFor.
+     \param tag : tag of the request
+     \return the result of the request (see serialCompletion)
+     \return -EINVAL if no such request is in flight
+  */
+int serialUring::waitFor(uint64_t tag)
+{
+    tag&=~SERIALURING_TAG_RESERVED;
+    while (true)
+    {
+        reap();
+        for (unsigned int i=0;i<stashCount;i++)
+        {
+            if (stash[i].tag==tag)
+            {
+                int result=stash[i].result;
+                memmove(stash+i,stash+i+1,(stashCount-i-1)*sizeof(serialCompletion));
+                stashCount--;
+                return result;
+            }
+        }
+        if (inFlight==0 || !isAvailable()) return -EINVAL;
+        if (enter(sqPending,1)<0) return -errno;
+    }
+}
+
+
+/*!
+     \brief Number of requests queued or submitted whose completion has not been returned yet
+*/
+unsigned int serialUring::pending()
+{
+    return inFlight+stashCount;
+}
+
+
+/*!
+     \brief Number of io_uring_enter system calls performed since the ring was created
+*/
+unsigned long serialUring::getEnterCount()
+{
+    return enterCount;
+}
+
+
+
+//___________________________
+// ::: Ring implementation :::
+
+
+/*!
+     \brief Check if a request made of several submission entries can be queued
+     \param nbEntries : number of submission entries of the request
+     \return true if the ring and the completion stash have room for the request
+  */
+bool serialUring::hasRoom(unsigned int nbEntries)
+{
+#if defined (__linux__)
+    if (!isAvailable()) return false;
+    unsigned int head=__atomic_load_n(sqHead,__ATOMIC_ACQUIRE);
+    return sqLocalTail-head+nbEntries<=entries && inFlight+stashCount<entries;
+#else
+    UNUSED(nbEntries);
+    return false;
+#endif
+}
+
+
+/*!
+     \brief Take the next submission entry. Room must have been checked with hasRoom.
+     \return the cleared entry
+  */
+void* serialUring::nextSqe()
+{
+#if defined (__linux__)
+    unsigned int index=sqLocalTail & *sqMask;
+    struct io_uring_sqe *sqe=(struct io_uring_sqe*)sqes+index;
+    memset(sqe,0,sizeof(*sqe));
+    sqArray[index]=index;
+    sqLocalTail++;
+    sqPending++;
+    __atomic_store_n(sqTail,sqLocalTail,__ATOMIC_RELEASE);
+    return sqe;
+#else
+    return NULL;
+#endif
+}
+
+
+/*!
+     \brief Append a linked timeout to the entry which has just been queued
+     \param sqe : entry of the request
+     \param timeOut_ms : delay before cancelling the request, 0 for no timeout
+     \return the entry of the timeout, NULL if there is no timeout
+  */
+void* serialUring::linkTimeout(void *sqe,unsigned int timeOut_ms)
+{
+#if defined (__linux__)
+    if (timeOut_ms==0) return NULL;
+    ((struct io_uring_sqe*)sqe)->flags|=IOSQE_IO_LINK;
+
+    // The timespec lives in the slot of the timeout entry until it is submitted
+    struct io_uring_sqe *timeoutSqe=(struct io_uring_sqe*)nextSqe();
+    struct __kernel_timespec *ts=(struct __kernel_timespec*)timeouts+(timeoutSqe-(struct io_uring_sqe*)sqes);
+    ts->tv_sec=timeOut_ms/1000;
+    ts->tv_nsec=(timeOut_ms%1000)*1000000L;
+
+    timeoutSqe->opcode=IORING_OP_LINK_TIMEOUT;
+    timeoutSqe->fd=-1;
+    timeoutSqe->addr=(uint64_t)(uintptr_t)ts;
+    timeoutSqe->len=1;
+    timeoutSqe->user_data=SERIALURING_TAG_RESERVED;
+    return timeoutSqe;
+#else
+    UNUSED(sqe); UNUSED(timeOut_ms);
+    return NULL;
+#endif
+}
+
+
+/*!
+     \brief Move the available completion entries to the stash. Timeout completions are dropped.
+*/
+void serialUring::reap()
+{
+#if defined (__linux__)
+    if (!isAvailable()) return;
+    unsigned int head=*cqHead;
+    unsigned int tail=__atomic_load_n(cqTail,__ATOMIC_ACQUIRE);
+    while (head!=tail)
+    {
+        struct io_uring_cqe *cqe=(struct io_uring_cqe*)cqes+(head & *cqMask);
+        if (!(cqe->user_data & SERIALURING_TAG_RESERVED))
+        {
+            stash[stashCount].tag=cqe->user_data;
+            // Requests are only cancelled by their linked timeout
+            stash[stashCount].result=(cqe->res==-ECANCELED) ? -ETIME : cqe->res;
+            stashCount++;
+            inFlight--;
+        }
+        head++;
+    }
+    __atomic_store_n(cqHead,head,__ATOMIC_RELEASE);
+#endif
+}
+
+
+/*!
+     \brief Submit the pending entries and optionally wait for completions
+     \param toSubmit : number of entries to submit
+     \param minComplete : number of completions to wait for
+     \return >=0 number of entries submitted
+     \return -1 error (errno is set)
+  */
+int serialUring::enter(unsigned int toSubmit,unsigned int minComplete)
+{
+#if defined (__linux__)
+    while (true)
+    {
+        enterCount++;
+        int ret=syscall(__NR_io_uring_enter,ringFd,toSubmit,minComplete,
+                        minComplete>0 ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+        if (ret>=0)
+        {
+            sqPending-=ret;
+            return ret;
+        }
+        if (errno!=EINTR) return -1;
+    }
+#else
+    UNUSED(toSubmit); UNUSED(minComplete);
+    return -1;
+#endif
+}
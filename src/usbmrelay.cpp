@@ -6,11 +6,22 @@
 #include <sstream>
 #include <iomanip>
 #include <vector>
+#include <algorithm>
+#include <bit>
+#include <chrono>
 
 #ifdef _WIN32
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
 #endif
 
 using std::string;
@@ -18,42 +29,96 @@ using std::cerr;
 using std::cout;
 using std::endl;
 
-// Function to sleep for a specified number of milliseconds, platform-dependent
+// Function to sleep for a specified number of milliseconds, from now. Sequences of sleeps
+// should use sleepUntil with deadlines computed from one start instead, see deadline.hpp.
 void os_sleep(unsigned long milliseconds) {
+    sleepUntil(SteadyClock::now() + std::chrono::milliseconds(milliseconds));
+}
+
+// Tells whether the node of a serial device exists, to see a USB adapter unplugged and plugged
+// back in. Always true on Windows, where the ports have no node.
+// Parameters: device - the port of the board
+// Returns: true if the node exists
+static bool deviceNodeExists(const std::string &device) {
 #ifdef _WIN32
-    Sleep(milliseconds); // Windows-specific sleep function
+    (void)device;
+    return true;
 #else
-    usleep(milliseconds * 1000); // Unix-specific sleep function
+    struct stat node;
+    return stat(device.c_str(), &node) == 0;
 #endif
 }
 
 // Constructor for the Usbmrelay class, initializes the port and relay number
 // Parameters: port - the communication port for the USB relay
-//             relaynumber - the number of relays on the device
+//             relaynumber - the number of relays on the device, from 1 to USBMRELAY_MAX_RELAYS
 Usbmrelay::Usbmrelay(const std::string &port, int relaynumber) {
     this->device = port;
     this->baudrate = 9600; // Default baud rate
-    this->delay = 20; // Default delay
+    if (relaynumber < 1)
+        relaynumber = 1;
+    if (relaynumber > USBMRELAY_MAX_RELAYS)
+        relaynumber = USBMRELAY_MAX_RELAYS;
     this->relaynumber = relaynumber;
+    this->responses = RelayFrameParser(relaynumber);
+    encodeFrames(0, allRelays(), this->failsafe);
+}
+
+// Destructor, stops the refresh, writer and reconnect threads
+Usbmrelay::~Usbmrelay() {
+    stopRefresh();
+    stopWriter();
+    stopReconnect();
 }
 
 // Opens the communication with the USB relay device
 // Returns: 1 if the device is successfully opened, -1 otherwise
 int Usbmrelay::openCom() {
-    this->boardinterface = std::make_unique<serialib>(); // Create a new serial interface
+    stopReconnect();
+    std::lock_guard<std::mutex> query(querylock); // No status query reads the previous interface
+    {
+        std::lock_guard<PriorityMutex> lock(framelock); // No frame is written to the previous interface
+        portready.store(false);
+        waitPortIdle(); // Nor a fail-safe frame
+        this->boardinterface = std::make_unique<serialib>(); // Create a new serial interface
+    }
+    this->boardinterface->setTracer(this->tracer, this->traceport); // Keep tracing across reconnections
     const char *device = this->device.c_str();
     this->boardinterface->openDevice(device, baudrate); // Open device with baud rate
     os_sleep(1); // Sleep for 1 millisecond
     if (!this->boardinterface->isDeviceOpen()) { // Check if the device opened successfully
         return -1; // Return -1 if the device is not open
     }
+    this->connected = true;
+    portready.store(true, std::memory_order_release);
+    this->devicestamp = deviceStamp(this->device);
+    if (!this->statefile.empty() && this->statestore.open(this->statefile, this->device, this->relaynumber) == 1) {
+        uint64_t state, stamp;
+        bool initialized;
+        // Resume from the last snapshot, unless the device has been reconnected since (or the
+        // connection cannot be identified): the board may have lost power and need a new init
+        if (this->statestore.load(state, initialized, stamp) == 1 && this->devicestamp != 0 && stamp == this->devicestamp) {
+            this->boardstate = state & allRelays();
+            this->initialized = initialized;
+        }
+        int delay;
+        if (this->statestore.loadDelay(delay) == 1) // Calibrated by calibrateDelay
+            this->delay = delay;
+    }
+    publishMirror();
     return 1; // Return 1 if the device is open
 }
 
 // Closes the communication with the USB relay device
 // Returns: 1 if the device is successfully closed, -1 otherwise
 int Usbmrelay::closeCom() {
-    this->boardinterface->closeDevice(); // Close the device
+    stopRefresh();
+    stopReconnect();
+    std::lock_guard<std::mutex> query(querylock); // No status query reads the device
+    {
+        std::lock_guard<PriorityMutex> lock(framelock);
+        closePort(); // Close the device
+    }
     if (this->boardinterface->isDeviceOpen()) { // Check if the device closed successfully
         return -1; // Return -1 if the device is still open
     }
@@ -63,9 +128,9 @@ int Usbmrelay::closeCom() {
 // Adds a character to the receive buffer (FIFO style)
 // Parameters: elt - the character to add to the receive buffer
 void Usbmrelay::bufferrxAdd(char elt) {
-    int length = sizeof(this->bufferrx);
-    for (int k = length - 1; k >= 0; k--) {
-        this->bufferrx[k + 1] = this->bufferrx[k]; // Shift elements to the right
+    int length = this->bufferrx.size();
+    for (int k = length - 1; k > 0; k--) {
+        this->bufferrx[k] = this->bufferrx[k - 1]; // Shift elements to the right, dropping the oldest
     }
     this->bufferrx[0] = elt; // Add new element at the start
 }
@@ -73,42 +138,218 @@ void Usbmrelay::bufferrxAdd(char elt) {
 // Adds a character to the transmit buffer (FIFO style)
 // Parameters: elt - the character to add to the transmit buffer
 void Usbmrelay::buffertxAdd(char elt) {
-    int length = sizeof(this->buffertx);
-    for (int k = length - 1; k >= 0; k--) {
-        this->buffertx[k + 1] = this->buffertx[k]; // Shift elements to the right
+    int length = this->buffertx.size();
+    for (int k = length - 1; k > 0; k--) {
+        this->buffertx[k] = this->buffertx[k - 1]; // Shift elements to the right, dropping the oldest
     }
     this->buffertx[0] = elt; // Add new element at the start
 }
 
-// Sends data to the USB relay and waits for the specified time
+// Sends data to the USB relay and waits for the specified time. The board drops a frame which
+// comes before the end of the delay after the previous one, so every write first waits for the
+// delay of the last write to pass, whoever wrote it: a status query or urgent frames written
+// back to back hold the next write for the delay of the board.
 // Parameters: data - the data to send
-//             milliseconds - the number of milliseconds to wait after sending
+//             nbyte - the number of bytes to send
+//             milliseconds - the number of milliseconds to wait after sending, 0 to leave the
+//                            delay of the board to the next write
 // Returns: the status of the write operation
-int Usbmrelay::send(std::vector<int> data, unsigned long milliseconds) {
-    char buffer[data.size()] = {0};
-    for(int i = 0; i <= data.size() - 1; i++) {
+int Usbmrelay::send(const char* data, unsigned int nbyte, unsigned long milliseconds) {
+    for(unsigned int i = 0; i < nbyte; i++)
         this->buffertxAdd(data[i]);
-        buffer[i] = data[i];
-    }
-    int status = this->boardinterface->writeBytes(buffer, data.size()); // Write data to device
-    os_sleep(milliseconds); // Sleep for the specified time
+    this->framecount++;
+    sleepUntil(this->nextframe);
+    int status = this->boardinterface->writeBytes(data, nbyte); // Write data to device
+#ifdef _WIN32
+    this->writeerror = status == -1 ? (int)GetLastError() : 0;
+#else
+    this->writeerror = status == -1 ? errno : 0; // Not a driver error on a timeout
+#endif
+    unsigned long gap = milliseconds > 0 ? milliseconds : std::max(delay.load(), 0);
+    this->nextframe = SteadyClock::now() + std::chrono::milliseconds(gap);
+    if (milliseconds > 0)
+        sleepUntil(this->nextframe); // Sleep for the specified time
     return status; // Return the status of the write operation
 }
 
-// Receives a specified number of bytes from the USB relay
-// Parameters: nbyte - the number of bytes to receive
-// Returns: the status of the last read operation
-int Usbmrelay::recieve(int nbyte) {
-    int status;
-    for (int k = 1; k <= nbyte; k++) {
-        char tempbuffer[2];
-        status = this->boardinterface->readChar(tempbuffer, 500); // Read character with 500ms timeout
-        this->bufferrxAdd(tempbuffer[0]); // Add received character to buffer
-        if (status != 1) {
-            return status; // Return status if read operation failed
+// Returns: the mask of the relays of the board, bit i for relay i+1
+uint64_t Usbmrelay::allRelays() {
+    return relaynumber >= 64 ? ~0ULL : (1ULL << relaynumber) - 1;
+}
+
+// Encodes the frames of the selected relays in one pass, in relay order
+// Parameters: state - the relay states, bit i for relay i+1
+//             relays - the relays to encode, bit i for relay i+1
+//             buffer - receives the frames, at least 4 * USBMRELAY_MAX_RELAYS bytes
+// Returns: the number of bytes encoded, 4 per relay
+int Usbmrelay::encodeFrames(uint64_t state, uint64_t relays, char* buffer) {
+    int nbyte = 0;
+    for (uint64_t pending = relays & allRelays(); pending != 0; pending &= pending - 1) {
+        int i = std::countr_zero(pending) + 1;
+        int kstate = (state >> (i - 1)) & 1;
+        buffer[nbyte++] = (char)0xA0;
+        buffer[nbyte++] = (char)i;
+        buffer[nbyte++] = (char)kstate;
+        buffer[nbyte++] = (char)(0xA0 + i + kstate); // Checksum, modulo 256
+    }
+    return nbyte;
+}
+
+// Returns: the current time of the steady clock in nanoseconds
+static uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(SteadyClock::now().time_since_epoch()).count();
+}
+
+// Applies the rate limits to a request: the pending changes are merged into it, and the
+// switches of limited relays which have no token left are removed from it and kept pending,
+// so that only the last state requested for a relay is sent once it gets a token back.
+// The limits only apply once the board is initialized.
+// The tokens are only spent by charge, once the frames are sent.
+// Parameters: state - the relay states, bit i for relay i+1, updated with the pending states
+//             relays - the relays of the request, updated with the relays to send
+// Returns: the limited relays which switch, to charge once their frame is sent
+uint64_t Usbmrelay::admit(uint64_t& state, uint64_t& relays) {
+    pendingrelays &= ~relays; // Superseded by the request
+    state = (state & relays) | (pendingstate & pendingrelays);
+    relays |= pendingrelays;
+    pendingrelays = 0;
+    uint64_t switches = (state ^ boardstate) & relays & limitedrelays;
+    if (!initialized || switches == 0)
+        return 0;
+    uint64_t now = nowNs();
+    for (uint64_t pending = switches; pending != 0; pending &= pending - 1) {
+        int i = std::countr_zero(pending);
+        const RateLimit& limit = ratelimits[i];
+        uint64_t tat = limit.tat_ns > now ? limit.tat_ns : now;
+        if (tat - now > limit.tolerance_ns) { // No token: hold the switch back
+            relays &= ~(1ULL << i);
+            switches &= ~(1ULL << i);
+            pendingrelays |= 1ULL << i;
+        }
+    }
+    pendingstate = state & pendingrelays;
+    return switches;
+}
+
+// Spends a token of the limited relays switched by a frame which was sent, so that a failed
+// or preempted write does not count against the rate limit
+// Parameters: relays - the relays switched, bit i for relay i+1
+void Usbmrelay::charge(uint64_t relays) {
+    if (relays == 0)
+        return;
+    uint64_t now = nowNs();
+    for (; relays != 0; relays &= relays - 1) {
+        RateLimit& limit = ratelimits[std::countr_zero(relays)];
+        limit.tat_ns = (limit.tat_ns > now ? limit.tat_ns : now) + limit.interval_ns;
+    }
+}
+
+// Sends the frames of the selected relays and updates the shadow state. Without delay the
+// frames go out in a single write, otherwise they are written one by one, delay apart.
+// Between two frames the command gives way to the urgent commands issued since it was called,
+// and is then dropped: its remaining frames are obsolete.
+// Parameters: state - the relay states, bit i for relay i+1
+//             relays - the relays to send a frame to, bit i for relay i+1
+//             changesonly - skip the relays which are already in the requested state
+//             urgent - urgent lane: no rate limit, the relays which change are sent first and back
+//                      to back, with every relay counted as changing while the board is not initialized
+// Returns: 1 if every frame is sent, -1 if a write failed, -2 if preempted by an urgent command
+//          or a watchdog fail-safe, -3 if the port is lost and the state is kept for the automatic reconnection
+int Usbmrelay::writeFrames(uint64_t state, uint64_t relays, bool changesonly, bool urgent) {
+    uint64_t generation = urgent ? urgentcount.fetch_add(1, std::memory_order_acq_rel) + 1
+                                 : urgentcount.load(std::memory_order_acquire);
+    std::unique_lock<PriorityMutex> lock(framelock);
+    return writeFramesLocked(lock, generation, state, relays, changesonly, urgent, urgent ? 0 : delay.load());
+}
+
+// Body of writeFrames, called with the frame lock held
+// Parameters: lock - the frame lock, released between two frames
+//             generation - the number of urgent commands issued when the command was called
+//             framedelay - the delay after each frame in milliseconds, the delay of the board
+//                          except during calibrateDelay
+// Returns: see writeFrames
+int Usbmrelay::writeFramesLocked(std::unique_lock<PriorityMutex>& lock, uint64_t generation, uint64_t state,
+                                 uint64_t relays, bool changesonly, bool urgent, int framedelay) {
+    syncFailSafe();
+    if (!connected.load(std::memory_order_relaxed))
+        return holdForReconnect(state, relays);
+    char buffer[4 * USBMRELAY_MAX_RELAYS];
+    int nbyte;
+    uint64_t charged = 0;
+    if (urgent) {
+        pendingrelays = 0; // The held back switches are obsolete
+        uint64_t changes = initialized ? (state ^ boardstate) & relays : relays;
+        if (changesonly)
+            relays = changes;
+        nbyte = encodeFrames(state, changes, buffer);
+        nbyte += encodeFrames(state, relays & ~changes, buffer + nbyte);
+    }
+    else {
+        charged = admit(state, relays);
+        if (changesonly && initialized)
+            relays &= state ^ boardstate;
+        nbyte = encodeFrames(state, relays, buffer);
+    }
+    int framesize = framedelay > 0 ? 4 : nbyte;
+    for (int k = 0; k < nbyte; k += framesize) {
+        if (k > 0) { // Frame boundary
+            lock.unlock();
+            lock.lock();
+            if (syncFailSafe()) // Switched off by a watchdog: the rest of the command is dropped
+                return -2;
+            if (!connected.load(std::memory_order_relaxed)) // Lost by another command meanwhile
+                return holdForReconnect(state, relays);
         }
+        if (urgentcount.load(std::memory_order_acquire) != generation)
+            return -2;
+        if (send(buffer + k, framesize, framedelay > 0 ? framedelay : 0) != 1) {
+            if (autoreconnect && portLost())
+                return holdForReconnect(state, relays);
+            return -1;
+        }
+        uint64_t sent = 0;
+        for (int f = k; f < k + framesize; f += 4)
+            sent |= 1ULL << (buffer[f + 1] - 1);
+        charge(sent & charged);
+        boardstate = (boardstate & ~sent) | (state & sent);
+        saveState();
+    }
+    if(!initialized && (relays & allRelays()) == allRelays()) { // Every relay got a frame: the board is initialized
+        initialized = true;
+        saveState();
     }
-    return status; // Return status of the last read operation
+    return 1;
+}
+
+// Receives the responses of the USB relay and parses the frames they contain
+// Parameters: nbyte - the number of bytes to wait for, at most 500 ms
+// Returns: the number of valid frames received, -1 if the read failed
+int Usbmrelay::recieve(int nbyte) {
+    char buffer[SERIALIB_RX_BUFFER_SIZE];
+    int frames = 0;
+    SteadyClock::time_point deadline = SteadyClock::now() + std::chrono::milliseconds(500);
+    while (nbyte > 0) {
+        long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - SteadyClock::now()).count();
+        if (remaining <= 0)
+            break;
+        int status = this->boardinterface->readBytes(buffer, std::min<int>(nbyte, sizeof(buffer)), remaining);
+        if (status < 0)
+            return -1;
+        if (status == 0)
+            break;
+        for (int i = 0; i < status; i++)
+            this->bufferrxAdd(buffer[i]);
+        frames += this->responses.feed(buffer, status, [](const RelayFrame&) {});
+        nbyte -= status;
+    }
+    return frames;
+}
+
+// Returns the counters of the parser of the board responses: valid frames, frames dropped
+// because of their checksum and bytes skipped to resynchronize on a frame header
+// Returns: the counters since the construction
+RelayFrameStats Usbmrelay::getFrameStats() {
+    return this->responses.getStats();
 }
 
 // Returns the relay number of the USB relay
@@ -137,7 +378,8 @@ int Usbmrelay::setPort(const std::string &port) {
     return 1;
 }
 
-// Sets the delay between operations on the USB relay
+// Sets the delay between operations on the USB relay. Can be called from any thread: a command
+// or a fail-safe sequence in progress keeps the delay it started with.
 // Parameters: delay - the delay in milliseconds
 // Returns: 1 if successful
 int Usbmrelay::setDelay(int delay) {
@@ -145,68 +387,898 @@ int Usbmrelay::setDelay(int delay) {
     return 1;
 }
 
+// Returns the delay between operations on the USB relay
+// Returns: delay - the delay in milliseconds
+int Usbmrelay::getDelay() {
+    return delay;
+}
+
+// Finds the shortest inter-frame delay the board keeps up with, and sets the delay to it plus
+// a margin. Test patterns are sent to every relay with a gap stepped down from startms, and
+// read back after settlems: the last gap at which the board applied every frame is kept.
+// The delay is saved in the state file, if any, and restored by openCom. The relays are set
+// back to their state before the calibration whatever the result, unless an urgent command
+// was issued meanwhile: the calibration stops and the relays are left in its state.
+// The relays switch during the calibration: disconnect the loads first.
+// Parameters: readback - reads the state the relays are really in
+//             marginpercent - the margin added to the shortest delay, at least 1 ms
+//             startms - the first gap tested, which the board must keep up with
+//             settlems - the time given to the relays before a readback
+// Returns: the calibrated delay in milliseconds, -1 if a write or a readback failed,
+//          -2 if the board misses frames even at startms, -3 if preempted by an urgent command
+int Usbmrelay::calibrateDelay(const RelayReadback& readback, int marginpercent, int startms, int settlems) {
+    const uint64_t patterns[] = {~0ULL, 0, 0x5555555555555555ULL, 0xAAAAAAAAAAAAAAAAULL};
+    uint64_t generation = urgentcount.load(std::memory_order_acquire); // Preempted by any later urgent command
+    uint64_t restore = getStateMask();
+    int safe = -1;
+    int status = 1;
+    for (int gap = startms; gap >= 0 && status == 1; gap = gap > 0 ? gap - std::max(1, gap / 4) : -1) {
+        bool applied = true;
+        for (uint64_t pattern : patterns) {
+            pattern &= allRelays();
+            {
+                std::unique_lock<PriorityMutex> lock(framelock);
+                status = writeFramesLocked(lock, generation, pattern, allRelays(), false, true, gap);
+            }
+            if (status != 1)
+                break;
+            os_sleep(settlems);
+            uint64_t state;
+            if (readback(state) != 1) {
+                status = -1;
+                break;
+            }
+            if ((state & allRelays()) != pattern) {
+                applied = false;
+                break;
+            }
+        }
+        if (status != 1 || !applied)
+            break;
+        safe = gap;
+    }
+    std::unique_lock<PriorityMutex> lock(framelock);
+    int result = status == -2 ? -3 : status != 1 ? -1 : safe < 0 ? -2 : safe + std::max(1, safe * marginpercent / 100);
+    if (result > 0) {
+        this->delay = result;
+        this->statestore.saveDelay(result);
+    }
+    if (status != -2) { // Back to the state before the calibration, unless an urgent command took over
+        status = writeFramesLocked(lock, generation, restore, allRelays(), false, true, this->delay);
+        if (status == -2)
+            result = -3;
+        else if (status != 1)
+            result = -1;
+    }
+    return result;
+}
+
+// Reads the state the relays are really in, for boards whose firmware answers a status query.
+// A readback younger than the cache lifetime is returned without serial traffic; the cache is
+// dropped whenever a frame is written. A fresh readback also becomes the shadow state, so that
+// the next setStateMask corrects a relay switched by hand or reset by a brownout. The frame
+// lock is released while the board answers, so that the commands are not held back by a query.
+// Parameters: state - receives the relay states, bit i for relay i+1
+// Returns: 1 if successful, -1 if the board did not answer, -2 if a frame was written while
+//          the board answered: the answer may predate it and is dropped
+int Usbmrelay::queryState(uint64_t& state) {
+    std::lock_guard<std::mutex> query(querylock);
+    std::unique_lock<PriorityMutex> lock(framelock);
+    syncFailSafe();
+    if (queryvalid && SteadyClock::now() - querytime < std::chrono::milliseconds(queryttlms)) {
+        state = querystate;
+        return 1;
+    }
+    return refreshLocked(lock, state);
+}
+
+// Sets how long a readback of queryState is reused
+// Parameters: ttlms - the lifetime of the cache in milliseconds, 0 to query the board every time
+// Returns: 1 if successful
+int Usbmrelay::setQueryTtl(unsigned int ttlms) {
+    std::lock_guard<PriorityMutex> lock(framelock);
+    this->queryttlms = ttlms;
+    return 1;
+}
+
+// Replaces the status query of the board, for firmwares which do not answer the 0xFF query
+// Parameters: query - reads the relay states, called with the frame lock held; an empty
+//             function restores the 0xFF query
+// Returns: 1 if successful
+int Usbmrelay::setStateQuery(const RelayReadback& query) {
+    std::lock_guard<PriorityMutex> lock(framelock);
+    this->statequery = query;
+    this->queryvalid = false;
+    return 1;
+}
+
+// Refreshes the shadow state from the board in a background thread, between commands: a
+// refresh which would have to wait for a command is skipped. Stopped by closeCom, or after
+// USBMRELAY_REFRESH_FAILURES queries in a row without answer: the firmware of the board does
+// not answer the status query, see setStateQuery.
+// Parameters: periodms - the time between two refreshes in milliseconds, 0 to stop
+// Returns: 1 if successful
+int Usbmrelay::setAutoRefresh(unsigned int periodms) {
+    stopRefresh();
+    if (periodms == 0)
+        return 1;
+    refreshstop.store(false);
+    refresher = std::thread(&Usbmrelay::refreshLoop, this, periodms);
+    return 1;
+}
+
+// Body of the refresh thread
+// Parameters: periodms - the time between two refreshes in milliseconds
+void Usbmrelay::refreshLoop(unsigned int periodms) {
+    int failures = 0; // Queries in a row without answer
+    while (!refreshstop.load() && failures < USBMRELAY_REFRESH_FAILURES) {
+        for (unsigned int waited = 0; waited < periodms && !refreshstop.load(); waited += 10)
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::min(10u, periodms - waited)));
+        std::unique_lock<std::mutex> query(querylock, std::try_to_lock);
+        if (!query.owns_lock())
+            continue;
+        std::unique_lock<PriorityMutex> lock(framelock, std::try_to_lock);
+        if (!lock.owns_lock() || refreshstop.load() || !connected.load(std::memory_order_acquire))
+            continue;
+        syncFailSafe();
+        uint64_t state;
+        int status = refreshLocked(lock, state);
+        failures = status == -1 ? failures + 1 : 0;
+    }
+}
+
+// Stops the refresh thread
+void Usbmrelay::stopRefresh() {
+    refreshstop.store(true);
+    if (refresher.joinable())
+        refresher.join();
+}
+
+// Reads the board and updates the cache and the shadow state, under the query and frame locks
+// Parameters: lock - the frame lock, released while the board answers
+//             state - receives the relay states, bit i for relay i+1
+// Returns: see queryState
+int Usbmrelay::refreshLocked(std::unique_lock<PriorityMutex>& lock, uint64_t& state) {
+    int status = readStatusLocked(lock, state);
+    if (status != 1)
+        return status;
+    state &= allRelays();
+    if (state != boardstate) {
+        boardstate = state;
+        saveState();
+    }
+    this->querystate = state;
+    this->querytime = SteadyClock::now();
+    this->queryvalid = true;
+    return 1;
+}
+
+// Sends the status query and parses the answer: one frame per relay (0xA0, channel, state,
+// checksum) or text such as "CH1:ON CH2:OFF", depending on the firmware. Called under the
+// query and frame locks; the frame lock is released while the board answers, the query lock
+// keeps the other queries and the reconnection off the port meanwhile.
+// Parameters: lock - the frame lock
+//             state - receives the relay states, bit i for relay i+1
+// Returns: 1 if every relay was reported, -1 otherwise, -2 if a frame was written meanwhile
+int Usbmrelay::readStatusLocked(std::unique_lock<PriorityMutex>& lock, uint64_t& state) {
+    if (this->statequery)
+        return this->statequery(state);
+    if (!this->boardinterface || !connected.load(std::memory_order_acquire))
+        return -1;
+    this->boardinterface->flushReceiver(); // Drop stale answers
+    this->responses.reset(); // and the partial frame they may have left in the parser
+    const char query = (char)0xFF;
+    if (send(&query, 1, 0) != 1) // After the delay of the last frame, and before the one of the query
+        return -1;
+    uint64_t generation = urgentcount.load(std::memory_order_acquire);
+    uint64_t written = this->framecount;
+    this->querybusy = true;
+    lock.unlock();
+    char buffer[512];
+    int size = 0;
+    bool failed = false;
+    uint64_t binary = 0, binaryseen = 0, text = 0, textseen = 0;
+    SteadyClock::time_point deadline = SteadyClock::now() + std::chrono::milliseconds(USBMRELAY_QUERY_TIMEOUT_MS);
+    while (binaryseen != allRelays() && textseen != allRelays() && size < (int)sizeof(buffer)) {
+        long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - SteadyClock::now()).count();
+        if (remaining <= 0)
+            break;
+        // Wait for one byte, then take whatever else has arrived
+        int count = this->boardinterface->readBytes(buffer + size, 1, remaining);
+        if (count < 0)
+            failed = true;
+        if (count <= 0)
+            break;
+        int more = std::min(this->boardinterface->available(), (int)sizeof(buffer) - size - 1);
+        if (more > 0)
+            count += std::max(0, this->boardinterface->readBytes(buffer + size + 1, more, 1));
+        this->responses.feed(buffer + size, count, [&](const RelayFrame& frame) {
+            uint64_t bit = 1ULL << (frame.channel - 1);
+            binary = frame.state ? binary | bit : binary & ~bit;
+            binaryseen |= bit;
+        });
+        size += count;
+        // Text answers are scanned again from the start, they are only a few hundred bytes
+        text = textseen = 0;
+        for (int i = 0; i + 2 < size; i++) {
+            if (buffer[i] != 'C' || buffer[i + 1] != 'H')
+                continue;
+            int j = i + 2, channel = 0;
+            while (j < size && buffer[j] >= '0' && buffer[j] <= '9')
+                channel = channel * 10 + buffer[j++] - '0';
+            while (j < size && (buffer[j] == ':' || buffer[j] == ' '))
+                j++;
+            if (channel < 1 || channel > relaynumber || j + 1 >= size || buffer[j] != 'O')
+                continue;
+            bool on = buffer[j + 1] == 'N';
+            if (!on && (j + 2 >= size || buffer[j + 1] != 'F' || buffer[j + 2] != 'F'))
+                continue;
+            uint64_t bit = 1ULL << (channel - 1);
+            text = on ? text | bit : text & ~bit;
+            textseen |= bit;
+        }
+    }
+    lock.lock();
+    this->querybusy = false;
+    for (int i = 0; i < size; i++)
+        this->bufferrxAdd(buffer[i]);
+    // Frames written meanwhile, by a command or a watchdog, may have switched relays after the answer
+    bool stale = urgentcount.load(std::memory_order_acquire) != generation || this->framecount != written;
+    if (syncFailSafe() || stale)
+        return -2;
+    if (failed)
+        return -1;
+    if (binaryseen == allRelays())
+        state = binary;
+    else if (textseen == allRelays())
+        state = text;
+    else
+        return -1;
+    return 1;
+}
+
+// Returns the frame plan of the all-off sequence, from a single read of the delay of the
+// board. The watchdog takes it once per fail-safe and hands it back to writeFailSafeFrame, so
+// that both sides walk the same frames even if the delay changes meanwhile.
+// Returns: the plan, one frame per relay with the board delay, or a single frame without delay
+RelayFailSafePlan Usbmrelay::getFailSafePlan() {
+    int framedelay = delay;
+    RelayFailSafePlan plan;
+    plan.frames = framedelay > 0 ? relaynumber : 1;
+    plan.delayms = framedelay > 0 ? framedelay : 0;
+    return plan;
+}
+
+// Writes one frame of the all-off sequence encoded by the constructor, for a watchdog.
+// Does not allocate, does not take the frame lock and never waits for the port: the frame is
+// written with a single non-blocking call, and dropped if the driver buffer is full. It goes
+// out between two writes of a command in progress on another thread, which is dropped at its
+// next frame boundary, where the shadow state is updated. The last frame publishes all-off to
+// the mirror, if any.
+// Parameters: index - the frame, from 0 to plan.frames - 1
+//             plan - the plan given by getFailSafePlan
+// Returns: 1 if the frame is written, 0 if the plan has no such frame, -1 if the write failed,
+//          the driver buffer is full or the port is closed or being reopened
+int Usbmrelay::writeFailSafeFrame(int index, const RelayFailSafePlan& plan) {
+    if ((plan.frames != 1 && plan.frames != relaynumber) || index < 0 || index >= plan.frames)
+        return 0;
+    int framesize = 4 * relaynumber / plan.frames;
+    failsafesent.store(true, std::memory_order_release);
+    int status = -1;
+    portusers.fetch_add(1); // Keeps the interface open, see waitPortIdle
+    if (portready.load())
+        status = this->boardinterface->tryWriteBytes(failsafe + index * framesize, framesize);
+    if (index == plan.frames - 1) // Every relay is off
+        publishMirror();
+    if (portusers.fetch_sub(1) == 1)
+        portusers.notify_all();
+    return status == 1 ? 1 : -1;
+}
+
+// Accounts for a watchdog fail-safe, under the frame lock: the relays are off. A command the
+// watchdog interrupted may still switch some relays on afterwards, so the board is marked
+// not initialized: the next command sends a frame to every relay.
+// Returns: true if a fail-safe was written since the last call
+bool Usbmrelay::syncFailSafe() {
+    if (!failsafesent.load(std::memory_order_relaxed) || !failsafesent.exchange(false, std::memory_order_acq_rel))
+        return false;
+    boardstate = 0;
+    initialized = false;
+    pendingrelays = 0;
+    saveState();
+    return true;
+}
+
+// Waits until no fail-safe frame is being written, once portready is cleared: a fail-safe
+// frame which starts afterwards sees the port closed and is skipped. Only the fail-safe
+// writers are waited for, the frames of the commands are kept out by the frame lock.
+void Usbmrelay::waitPortIdle() {
+    for (int users = portusers.load(); users != 0; users = portusers.load())
+        portusers.wait(users);
+}
+
+// Closes the port once no fail-safe frame is being written to it, with the frame lock held or
+// from the reconnect thread during an outage; the fail-safe frames are skipped until the port
+// is reopened
+void Usbmrelay::closePort() {
+    portready.store(false);
+    waitPortIdle();
+    this->boardinterface->closeDevice();
+}
+
+// Records every byte sent to and received from the board in a binary trace log. A fail-safe
+// frame is skipped while the tracer is swapped: set it before starting a watchdog.
+// Parameters: tracer - an open trace log, nullptr to disable tracing
+//             portid - the id of the board in the log
+// Returns: 1 if successful
+int Usbmrelay::setTracer(serialTracer* tracer, int portid) {
+    std::lock_guard<std::mutex> query(querylock); // No status query reads the device
+    std::lock_guard<PriorityMutex> lock(framelock); // No frame is being written
+    this->tracer = tracer;
+    this->traceport = portid;
+    if (!connected.load()) // The reconnect thread owns the port, and sets the tracer on reopen
+        return 1;
+    bool ready = portready.exchange(false);
+    waitPortIdle(); // Nor a fail-safe frame
+    if (this->boardinterface)
+        this->boardinterface->setTracer(tracer, portid);
+    portready.store(ready);
+    return 1;
+}
+
+// Persists the relay states and the init status of the board in a memory-mapped file,
+// reloaded by openCom so that a restarted program does not need to re-initialize the board.
+// The snapshot is only resumed on the same device connection, see deviceStamp: on Windows,
+// where the connection cannot be identified, the board is always initialized again.
+// Parameters: path - the state file of this board, an empty string disables persistence
+// Returns: 1 if successful
+int Usbmrelay::setStateFile(const std::string &path) {
+    this->statefile = path;
+    if (path.empty())
+        this->statestore.close();
+    return 1;
+}
+
+// Publishes the relay states of the board in a shared memory mirror after every change, for
+// other processes to read with RelayStateMirrorReader. A publish costs a few stores under the
+// frame lock. A watchdog fail-safe publishes all-off itself once its last frame is written.
+// Parameters: mirror - an open mirror, nullptr to stop publishing
+//             slot - the slot of this board in the mirror
+// Returns: 1 if successful, -1 if the mirror has no such slot
+int Usbmrelay::setMirror(RelayStateMirror* mirror, int slot) {
+    std::lock_guard<PriorityMutex> lock(framelock);
+    if (mirror != nullptr && mirror->describe(slot, this->device, this->relaynumber) != 1)
+        return -1;
+    this->mirror.store(nullptr);
+    waitPortIdle(); // A fail-safe may still publish to the previous mirror
+    this->mirrorslot.store(slot);
+    this->mirror.store(mirror);
+    publishMirror();
+    return 1;
+}
+
+// Returns whether the board has been initialized, by initBoard, by a previous setState or in a
+// previous run on the same device connection. A board which is not initialized is initialized
+// by the next setState, which sends a frame for every relay, so initBoard is not needed.
+// Returns: true if the board is initialized
+bool Usbmrelay::isInitialized() {
+    return initialized;
+}
+
+// Writes the shadow state to the state file and to the mirror, if any
+void Usbmrelay::saveState() {
+    this->queryvalid = false; // The board was written, its last readback is stale
+    publishMirror();
+    if (!this->statestore.isOpen())
+        return;
+    this->statestore.save(boardstate, initialized, devicestamp);
+}
+
+// Publishes the state of the board to the mirror, if any, from a command or from a watchdog
+// fail-safe, without waiting. The slot has one writer at a time: a thread which finds another
+// one publishing leaves it a request and returns, and the publishing thread publishes the
+// latest state again before it leaves, so the last state always reaches the mirror.
+void Usbmrelay::publishMirror() {
+    mirrorrequests.fetch_add(1);
+    while (!mirrorbusy.exchange(true, std::memory_order_acquire)) {
+        uint64_t requests = mirrorrequests.load();
+        RelayStateMirror* target = this->mirror.load();
+        if (target != nullptr)
+            target->publish(this->mirrorslot.load(), getStateMask());
+        mirrorbusy.store(false, std::memory_order_release);
+        if (mirrorrequests.load() == requests) // No request meanwhile
+            return;
+    }
+}
+
 // Initializes the USB relay board
 // Returns: 1 if the board is successfully initialized, -1 otherwise
 int Usbmrelay::initBoard() {
-    int status;
-    for(int i = 1; i <= relaynumber; i++) {
-        std::vector<int> buffer = {0xA0, i, 0, 0xA0 + i};
-        status = send(buffer, delay);
-        if(status != 1) {
-            return -1;
+    initialized = false; // Force a frame for every relay
+    return writeFrames(0, allRelays());
+}
+
+// Limits the switching rate of a relay with a token bucket: the relay can switch burst times
+// in a row, then once every intervalms. A switch requested while the bucket is empty is not
+// dropped: the relay is switched to the last state requested as soon as it gets a token,
+// by the next setState or flushPending, or by the writer thread if it is running.
+// Parameters: relay - the relay, from 1 to the relay number
+//             intervalms - the minimum time between two switches in the long run, 0 to remove the limit
+//             burst - the number of switches allowed in a row
+// Returns: 1 if successful, -1 if the relay does not exist
+int Usbmrelay::setRateLimit(int relay, unsigned int intervalms, unsigned int burst) {
+    if (relay < 1 || relay > relaynumber)
+        return -1;
+    if (burst < 1)
+        burst = 1;
+    std::lock_guard<PriorityMutex> lock(framelock);
+    RateLimit& limit = ratelimits[relay - 1];
+    limit.interval_ns = (uint64_t)intervalms * 1000000;
+    limit.tolerance_ns = (burst - 1) * limit.interval_ns;
+    limit.tat_ns = 0;
+    if (intervalms > 0)
+        limitedrelays |= 1ULL << (relay - 1);
+    else
+        limitedrelays &= ~(1ULL << (relay - 1));
+    return 1;
+}
+
+// Sends the pending changes of the relays which got a token back
+// Returns: 1 if successful, -1 otherwise
+int Usbmrelay::flushPending() {
+    {
+        std::lock_guard<PriorityMutex> lock(framelock);
+        if (pendingrelays == 0)
+            return 1;
+    }
+    return writeFrames(0, 0, true);
+}
+
+// Returns the time until the next pending change can be sent by flushPending
+// Returns: the time in milliseconds (rounded up), -1 if no change is pending
+long Usbmrelay::pendingDelay() {
+    std::lock_guard<PriorityMutex> lock(framelock);
+    if (pendingrelays == 0)
+        return -1;
+    uint64_t now = nowNs();
+    uint64_t next = UINT64_MAX;
+    for (uint64_t pending = pendingrelays; pending != 0; pending &= pending - 1) {
+        const RateLimit& limit = ratelimits[std::countr_zero(pending)];
+        uint64_t allowed = limit.tat_ns - limit.tolerance_ns;
+        if (allowed < next)
+            next = allowed;
+    }
+    return next > now ? (long)((next - now + 999999) / 1000000) : 0;
+}
+
+// Returns the relays with a change held back by their rate limit
+// Returns: the relays, bit i for relay i+1
+uint64_t Usbmrelay::getPendingMask() {
+    std::lock_guard<PriorityMutex> lock(framelock);
+    return pendingrelays;
+}
+
+// Sets the state of the relays from the urgent lane: the command in progress on another
+// thread stops at its next frame boundary and is dropped, as well as the switches held back
+// by a rate limit, then only the relays which change get a frame, all sent back to back in a
+// single write. Every relay counts as changing while the board is not initialized.
+// Parameters: state - the state of the relays, bit i for relay i+1
+// Returns: 1 if the state is successfully set, -1 if a write failed, -2 if preempted by a
+//          later urgent command, -3 if the port is lost (see setAutoReconnect)
+int Usbmrelay::setStateUrgent(uint64_t state) {
+    return writeFrames(state, allRelays(), true, true);
+}
+
+// Reopens the port automatically when the device is lost, for example when the USB adapter is
+// unplugged or reset: a write fails with EIO or ENODEV, or the node of the device is gone. A
+// write which only times out returns -1 as usual. The port is reopened in a background thread,
+// after 10 ms then twice as long after each failed attempt, up to maxbackoffms, or as soon as
+// the node of the device comes back. Meanwhile the commands return -3 and are
+// merged into one state: once the port is back, the board is initialized if it lost power and
+// every relay is sent this state.
+// Parameters: enable - true to reconnect automatically
+//             maxbackoffms - the longest wait between two attempts, in milliseconds
+// Returns: 1 if successful
+int Usbmrelay::setAutoReconnect(bool enable, unsigned int maxbackoffms) {
+    std::lock_guard<PriorityMutex> lock(framelock);
+    this->autoreconnect = enable;
+    this->maxbackoffms = maxbackoffms > USBMRELAY_RECONNECT_MIN_MS ? maxbackoffms : USBMRELAY_RECONNECT_MIN_MS;
+    return 1;
+}
+
+// Returns whether the port is usable, false during an outage handled by the automatic reconnection
+// Returns: true if the port is connected
+bool Usbmrelay::isConnected() {
+    return connected.load(std::memory_order_acquire);
+}
+
+// Returns the statistics of the automatic reconnection
+// Returns: the number of outages and attempts, the duration of the last outage
+RelayReconnectStats Usbmrelay::getReconnectStats() {
+    std::lock_guard<PriorityMutex> lock(framelock);
+    return reconnectstats;
+}
+
+// Keeps a command for the reconnection, and starts the reconnect thread on the first one.
+// Called with the frame lock held.
+// Parameters: state - the relay states, bit i for relay i+1
+//             relays - the relays set by the command, bit i for relay i+1
+// Returns: -3
+int Usbmrelay::holdForReconnect(uint64_t state, uint64_t relays) {
+    // Outage start, unless the restore of the reconnect thread failed: from the last known state
+    if (connected.exchange(false, std::memory_order_acq_rel) && !reconnecting) {
+        outagestart = SteadyClock::now();
+        reconnectstate = boardstate;
+    }
+    reconnectstate = (reconnectstate & ~pendingrelays) | (pendingstate & pendingrelays);
+    reconnectstate = (reconnectstate & ~relays) | (state & relays);
+    pendingrelays = 0;
+    if (!reconnecting) {
+        if (reconnector.joinable()) // Previous outage, the thread has released the lock
+            reconnector.join();
+        reconnecting = true;
+        reconnectstop.store(false);
+        reconnector = std::thread(&Usbmrelay::reconnectLoop, this);
+    }
+    return -3;
+}
+
+// Tells whether the last failed write means that the device is gone, rather than a board
+// which stalls: the driver reports the device removed, or its node has disappeared. Called
+// with the frame lock held, after send failed.
+// Returns: true if the port has to be reopened
+bool Usbmrelay::portLost() {
+#ifdef _WIN32
+    return writeerror == ERROR_DEVICE_NOT_CONNECTED || writeerror == ERROR_BAD_COMMAND ||
+           writeerror == ERROR_GEN_FAILURE || writeerror == ERROR_ACCESS_DENIED ||
+           writeerror == ERROR_OPERATION_ABORTED;
+#else
+    return writeerror == EIO || writeerror == ENODEV || writeerror == ENXIO || !deviceNodeExists(this->device);
+#endif
+}
+
+// Body of the reconnect thread: reopens the port with an exponential backoff, then restores
+// the relays. The node of the device is watched meanwhile, and the port is reopened as soon as
+// it comes back. While disconnected the commands keep off the port, which is reopened without
+// the frame lock; the restore takes it frame by frame, like any command.
+void Usbmrelay::reconnectLoop() {
+    unsigned int backoff = USBMRELAY_RECONNECT_MIN_MS;
+    bool vanished = false; // The node of the device has disappeared during the outage
+    SteadyClock::time_point back{}; // When the node came back, if it vanished
+    for (;;) {
+        for (unsigned int waited = 0; waited < backoff && !reconnectstop.load(); waited += 10) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::min(10u, backoff - waited)));
+            if (!deviceNodeExists(this->device)) {
+                vanished = true;
+                back = SteadyClock::time_point();
+            }
+            else if (vanished && back == SteadyClock::time_point()) {
+                back = SteadyClock::now(); // Plugged back in: reopen now
+                break;
+            }
+        }
+        {
+            std::lock_guard<PriorityMutex> lock(framelock);
+            if (reconnectstop.load()) {
+                reconnecting = false;
+                return;
+            }
+            if (querybusy) // A status query is still reading the port, try again after the backoff
+                continue;
+            reconnectstats.attempts++;
+        }
+        SteadyClock::time_point attempt = SteadyClock::now();
+        closePort();
+        if (this->boardinterface->openDevice(this->device.c_str(), baudrate) == 1) {
+            uint64_t stamp = deviceStamp(this->device);
+            std::unique_lock<PriorityMutex> lock(framelock);
+            if (reconnectstop.load()) { // closeCom or openCom is waiting for this thread
+                reconnecting = false;
+                return;
+            }
+            this->boardinterface->setTracer(this->tracer, this->traceport); // Set meanwhile, see setTracer
+            portready.store(true, std::memory_order_release);
+            if (stamp == 0 || stamp != this->devicestamp) { // New or unknown connection: the board lost power, its relays are off
+                this->devicestamp = stamp;
+                this->initialized = false;
+                this->boardstate = 0;
+            }
+            connected.store(true, std::memory_order_release);
+            uint64_t generation = urgentcount.load(std::memory_order_acquire);
+            int status = writeFramesLocked(lock, generation, reconnectstate, allRelays(), false, true, delay.load());
+            if (status == -1) // The board does not take the frames yet
+                holdForReconnect(0, 0);
+            else if (status != -3) { // Restored, or superseded by an urgent command or a fail-safe
+                SteadyClock::time_point restored = SteadyClock::now();
+                if (back == SteadyClock::time_point()) // The node stayed: back when reopened
+                    back = attempt;
+                reconnectstats.reconnects++;
+                reconnectstats.lastoutagems = std::chrono::duration<double, std::milli>(restored - outagestart).count();
+                reconnectstats.lastrestorems = std::chrono::duration<double, std::milli>(restored - back).count();
+                reconnecting = false;
+                return;
+            }
         }
+        backoff = std::min(backoff * 2, maxbackoffms);
     }
+}
+
+// Stops the reconnect thread, the commands kept for the reconnection are dropped
+void Usbmrelay::stopReconnect() {
+    reconnectstop.store(true);
+    if (reconnector.joinable())
+        reconnector.join();
+    std::lock_guard<PriorityMutex> lock(framelock);
+    reconnecting = false;
+}
+
+// Starts the writer thread, which sends the commands given to submitState
+// Returns: 1 if successful, -1 if the writer is already running
+int Usbmrelay::startWriter() {
+    if (writerrunning.exchange(true))
+        return -1;
+    writer = std::thread(&Usbmrelay::writerLoop, this);
     return 1;
 }
 
-// Sets the state of the relays using a command integer
-// Parameters: command - the command to set the state of the relays
-// Returns: 1 if the state is successfully set, -1 otherwise
+// Runs the writer thread in real-time mode, see enterRealtime: the commands submitted are then
+// sent without scheduler or page fault delays. Applied by the next startWriter. The frame lock,
+// shared with the refresh, reconnect and query threads and with getters such as gettx, has
+// priority inheritance (see PriorityMutex): a thread holding it while the writer waits runs at
+// the priority of the writer until it releases it. No lock of the board is taken by spinning.
+// Parameters: config - the real-time settings of the writer thread
+// Returns: 1 if successful, -1 if the writer is running
+int Usbmrelay::setWriterRealtime(const RealtimeConfig& config) {
+    if (writerrunning.load())
+        return -1;
+    this->writerrealtime = true;
+    this->writerconfig = config;
+    return 1;
+}
+
+// Returns the real-time settings the writer thread managed to apply, once it is started
+// Returns: the settings applied, all false if the real-time mode is not requested
+RealtimeStatus Usbmrelay::getWriterRealtime() {
+    std::lock_guard<PriorityMutex> lock(framelock);
+    return writerstatus;
+}
+
+// Stops the writer thread once it has sent the commands already submitted
+void Usbmrelay::stopWriter() {
+    if (!writerrunning.exchange(false))
+        return;
+    while (submitters.load() != 0) // A submitState which saw the writer running is pushing
+        std::this_thread::yield();
+    submitted.release();
+    writer.join();
+    drainCommands(); // Pushed after the last drain of the writer
+}
+
+// Submits a command to the writer thread, from any thread, without locking: the command is
+// queued and the call returns. The writer merges all the commands waiting in the queue into
+// one state, and sends a frame to the relays which change.
+// Parameters: state - the state of the relays, bit i for relay i+1
+//             relays - the relays set by this command, bit i for relay i+1
+// Returns: 1 if the command is queued, -1 if the queue is full or the writer is not running
+int Usbmrelay::submitState(uint64_t state, uint64_t relays) {
+    submitters.fetch_add(1); // Seen by stopWriter before it drains the queue for the last time
+    int status = -1;
+    if (writerrunning.load() && commands.push(Command{state, relays})) {
+        submitted.release();
+        status = 1;
+    }
+    submitters.fetch_sub(1, std::memory_order_release);
+    return status;
+}
+
+// Returns: the number of merged commands the writer thread failed to send
+uint64_t Usbmrelay::getWriterErrors() {
+    return writererrors.load(std::memory_order_relaxed);
+}
+
+// Body of the writer thread: drains the queue, merges the commands and sends the result. The
+// switches held back by a rate limit are flushed as soon as they get a token.
+void Usbmrelay::writerLoop() {
+    if (writerrealtime) {
+        RealtimeStatus status;
+        enterRealtime(writerconfig, &status);
+        std::lock_guard<PriorityMutex> lock(framelock);
+        writerstatus = status;
+    }
+    for (;;) {
+        while (submitted.try_acquire()) {} // One wake up for the whole queue
+        if (drainCommands())
+            continue;
+        if (!writerrunning.load(std::memory_order_acquire))
+            return;
+        long wait = pendingDelay();
+        if (wait < 0)
+            submitted.acquire(); // Sleeps until the next submit
+        else if (wait > 0 && submitted.try_acquire_for(std::chrono::milliseconds(wait)))
+            continue;
+        else if (flushPending() == -1)
+            writererrors.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Merges the commands waiting for the writer thread into one state and sends it, from the
+// writer thread or once it is stopped
+// Returns: true if a command was waiting
+bool Usbmrelay::drainCommands() {
+    Command command;
+    uint64_t state = 0, relays = 0;
+    while (commands.pop(command)) { // The last command wins for each relay
+        state = (state & ~command.relays) | (command.state & command.relays);
+        relays |= command.relays;
+    }
+    if (relays == 0)
+        return false;
+    if (writeFrames(state, relays, true) == -1)
+        writererrors.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Switches every relay off from the urgent lane, see setStateUrgent
+// Returns: 1 if every relay is off, -1 if a write failed, -2 if preempted by a later urgent command
+int Usbmrelay::emergencyOff() {
+    return setStateUrgent(0);
+}
+
+// Sets the state of the relays using a command integer, a frame is sent to every relay
+// except the switches held back by a rate limit
+// Parameters: command - the command to set the state of the relays, bit i for relay i+1
+// Returns: 1 if the state is successfully set, -1 if a write failed, -2 if preempted by an urgent command,
+//          -3 if the port is lost (see setAutoReconnect)
 int Usbmrelay::setState(int command) {
-    int status;
-    for(int i = 1; i <= relaynumber; i++) {
-        int kstate = command & 1;
-        std::vector<int> buffer = {0xA0, i, kstate, 0xA0 + i + kstate};
-        status = send(buffer, delay);
-        command = command >> 1;
-        if(status != 1) {
-            return -1;
+    return writeFrames((uint32_t)command, allRelays());
+}
+
+// Sets the state of up to 64 relays. Once the board is initialized, only the relays which
+// change get a frame.
+// Parameters: state - the state of the relays, bit i for relay i+1
+// Returns: 1 if the state is successfully set, -1 if a write failed, -2 if preempted by an urgent command,
+//          -3 if the port is lost (see setAutoReconnect)
+int Usbmrelay::setStateMask(uint64_t state) {
+    return writeFrames(state, allRelays(), true);
+}
+
+// Sets the state of up to 64 relays, see setStateMask
+// Parameters: state - the state of the relays, bit i for relay i+1
+// Returns: 1 if the state is successfully set, -1 if a write failed, -2 if preempted by an urgent command,
+//          -3 if the port is lost (see setAutoReconnect)
+int Usbmrelay::setState(const std::bitset<USBMRELAY_MAX_RELAYS> &state) {
+    return setStateMask(state.to_ullong());
+}
+
+// Sets the state of the relays using a command integer, without blocking the thread
+// Must be awaited from a coroutine running on a Scheduler. The command is dropped at the next
+// frame boundary if an urgent command is issued meanwhile, from any thread. Each frame is
+// written under the frame lock, so a synchronous command of another thread holding it delays
+// the Scheduler until its current frame and the delay after it are done.
+// Parameters: command - the command to set the state of the relays, bit i for relay i+1
+// Returns: a task giving 1 if the state is successfully set, -1 if a write failed, -2 if
+//          preempted by an urgent command, -3 if the port is lost (see setAutoReconnect)
+Task<int> Usbmrelay::setStateAsync(int command) {
+    co_return co_await writeFramesAsync((uint32_t)command, allRelays());
+}
+
+// Sets the state of some relays without blocking the thread, see setStateAsync. Once the
+// board is initialized, only the relays which change get a frame.
+// Parameters: state - the state of the relays, bit i for relay i+1
+//             relays - the relays to set, bit i for relay i+1, the others keep their state
+// Returns: a task giving the result, see setStateAsync
+Task<int> Usbmrelay::setStateMaskAsync(uint64_t state, uint64_t relays) {
+    co_return co_await writeFramesAsync(state, relays & allRelays(), true);
+}
+
+// Initializes the USB relay board without blocking the thread, see setStateAsync
+// Returns: a task giving 1 if the board is successfully initialized, a negative value otherwise
+Task<int> Usbmrelay::initBoardAsync() {
+    {
+        std::lock_guard<PriorityMutex> lock(framelock);
+        initialized = false; // Force a frame for every relay
+    }
+    co_return co_await writeFramesAsync(0, allRelays());
+}
+
+// Coroutine version of writeFrames. Each frame is written under the frame lock, which is not
+// held while suspended during the delay after it.
+// Parameters: state - the relay states, bit i for relay i+1
+//             relays - the relays to send a frame to, bit i for relay i+1
+//             changesonly - once the board is initialized, skip the relays already in state
+// Returns: a task giving the result, see writeFrames
+Task<int> Usbmrelay::writeFramesAsync(uint64_t state, uint64_t relays, bool changesonly) {
+    uint64_t generation = urgentcount.load(std::memory_order_acquire);
+    char buffer[4 * USBMRELAY_MAX_RELAYS];
+    int nbyte, framesize;
+    unsigned long framedelay;
+    uint64_t charged;
+    {
+        std::lock_guard<PriorityMutex> lock(framelock);
+        syncFailSafe();
+        if (!connected.load(std::memory_order_relaxed))
+            co_return holdForReconnect(state, relays);
+        charged = admit(state, relays);
+        if (changesonly && initialized)
+            relays &= state ^ boardstate;
+        nbyte = encodeFrames(state, relays, buffer);
+        framedelay = std::max(delay.load(), 0);
+        framesize = framedelay > 0 ? 4 : nbyte;
+    }
+    for (int k = 0; k < nbyte; k += framesize) {
+        if (k > 0 && framedelay > 0) // Let the other coroutines run until the next frame
+            co_await sleep_for(std::chrono::milliseconds(framedelay));
+        std::lock_guard<PriorityMutex> lock(framelock);
+        if (syncFailSafe()) // Switched off by a watchdog: the rest of the command is dropped
+            co_return -2;
+        if (!connected.load(std::memory_order_relaxed)) // Lost by another command meanwhile
+            co_return holdForReconnect(state, relays);
+        if (urgentcount.load(std::memory_order_acquire) != generation)
+            co_return -2;
+        if (send(buffer + k, framesize, 0) != 1) {
+            if (autoreconnect && portLost())
+                co_return holdForReconnect(state, relays);
+            co_return -1;
         }
-        boardstate[i - 1] = kstate;
+        uint64_t sent = 0;
+        for (int f = k; f < k + framesize; f += 4)
+            sent |= 1ULL << (buffer[f + 1] - 1);
+        charge(sent & charged);
+        boardstate = (boardstate & ~sent) | (state & sent);
+        saveState();
     }
-    return 1;
+    if (framedelay > 0 && nbyte > 0)
+        co_await sleep_for(std::chrono::milliseconds(framedelay));
+    if(!initialized && (relays & allRelays()) == allRelays()) { // Every relay got a frame: this call initialized the board
+        std::lock_guard<PriorityMutex> lock(framelock);
+        initialized = !syncFailSafe();
+        saveState();
+    }
+    co_return 1;
 }
 
-// Sets the state of the relays using a command array
-// Parameters: commandarray - array of commands to set the state of each relay
-// Returns: 1 if the state is successfully set, -1 otherwise
+// Sets the state of the relays using a command array, a frame is sent to every relay
+// except the switches held back by a rate limit
+// Parameters: commandarray - array of commands to set the state of each relay, 0 or 1
+// Returns: 1 if the state is successfully set, -1 if a write failed, -2 if preempted by an urgent command,
+//          -3 if the port is lost (see setAutoReconnect)
 int Usbmrelay::setState(int commandarray[]) {
-    int status;
-    for(int i = 1; i <= relaynumber; i++) {
-        std::vector<int> buffer = {0xA0, i, commandarray[i - 1], 0xA0 + i + commandarray[i - 1]};
-        status = send(buffer, delay);
-        if(status != 1)
-            return -1;
-        boardstate[i - 1] = commandarray[i - 1];
-    }
-    return 1;
+    uint64_t state = 0;
+    for(int i = 0; i < relaynumber; i++)
+        state |= (uint64_t)(commandarray[i] != 0) << i;
+    return writeFrames(state, allRelays());
 }
 
-// Returns the current state of the relay(s)
+// Returns the current state of the relay(s), from any thread
 // Returns: a vector representing the state of the relay(s)
 std::vector<int> Usbmrelay::getState() {
+    uint64_t mask = getStateMask();
+    std::vector<int> state(relaynumber);
+    for (int i = 0; i < relaynumber; i++)
+        state[i] = (mask >> i) & 1;
+    return state;
+}
+
+// Returns the current state of the relays as a mask. The state is one atomic word, so this
+// is a consistent snapshot read without locking, from any thread.
+// Returns: the state of the relays, bit i for relay i+1
+uint64_t Usbmrelay::getStateMask() {
+    if (failsafesent.load(std::memory_order_acquire)) // Switched off by a watchdog
+        return 0;
     return boardstate;
 }
 
 // Returns the transmit buffer
 // Returns: a vector of characters representing the transmit buffer
 std::vector<char> Usbmrelay::gettx() {
+    std::lock_guard<PriorityMutex> lock(framelock);
     return buffertx;
 }
 
 // Returns the receive buffer
 // Returns: a vector of characters representing the receive buffer
 std::vector<char> Usbmrelay::getrx() {
+    std::lock_guard<PriorityMutex> lock(framelock);
     return bufferrx;
 }
 
@@ -242,3 +1314,49 @@ std::bitset<8> charToBitset(char mychar) {
     std::bitset<8> mybitset(mychar);
     return mybitset;
 }
+
+// Identifies the current connection of a serial device. USB serial devices get a new device
+// node each time they are plugged in (and USB powered boards each time they are powered),
+// and the USB bus gives them a new device number: the identity changes when the board may
+// have been power-cycled, but not when the node is only chmod'ed or chown'ed by udev.
+// Parameters: device - the port of the board
+// Returns: a hash of the device number and inode of the node, its sysfs device path and the
+//          USB device number, 0 if unknown (always on Windows)
+uint64_t deviceStamp(const std::string &device) {
+#ifdef _WIN32
+    (void)device;
+    return 0;
+#else
+    struct stat info;
+    if (stat(device.c_str(), &info) != 0)
+        return 0;
+    uint64_t stamp = 14695981039346656037ULL; // FNV-1a
+    auto mix = [&stamp](const void* data, size_t size) {
+        for (size_t i = 0; i < size; i++)
+            stamp = (stamp ^ ((const unsigned char*)data)[i]) * 1099511628211ULL;
+    };
+    mix(&info.st_rdev, sizeof(info.st_rdev));
+    mix(&info.st_ino, sizeof(info.st_ino));
+#ifdef __linux__
+    char link[64], path[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/dev/char/%u:%u", major(info.st_rdev), minor(info.st_rdev));
+    if (realpath(link, path) != nullptr) {
+        mix(path, strlen(path));
+        // The nearest USB device above the tty, numbered by the bus at each enumeration
+        for (char* cut = strrchr(path, '/'); cut != nullptr && cut != path; cut = strrchr(path, '/')) {
+            *cut = 0;
+            std::string file = std::string(path) + "/devnum";
+            FILE* devnum = fopen(file.c_str(), "r");
+            if (devnum == nullptr)
+                continue;
+            unsigned int number;
+            if (fscanf(devnum, "%u", &number) == 1)
+                mix(&number, sizeof(number));
+            fclose(devnum);
+            break;
+        }
+    }
+#endif
+    return stamp != 0 ? stamp : 1;
+#endif
+}
@@ -0,0 +1,168 @@
+#include <serialib.hpp>
+#include <serialtracer.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+
+// Replays the transmit side of a trace captured with serialTracer against a serial port,
+// with the original timing or as fast as possible, then reports the timing drift and the
+// responses which differ from the capture.
+//
+// usbrelay_replay <trace file> <port> [--port-id N] [--fast] [--baud B] [--timeout ms]
+
+struct Run { //Consecutive records of one write or one read
+    uint64_t timestamp_ns;
+    uint8_t direction;
+    std::vector<char> data;
+};
+
+void usage(){
+    std::cerr << "usage: usbrelay_replay <trace file> <port> [--port-id N] [--fast] [--baud B] [--timeout ms]" << std::endl;
+}
+
+std::string toHex(const std::vector<char>& data){ //Format bytes for the mismatch report
+    static const char digits[] = "0123456789abcdef";
+    std::string text;
+    for(char c : data){
+        if(!text.empty())
+            text += ' ';
+        text += digits[(unsigned char)c >> 4];
+        text += digits[c & 0xf];
+    }
+    return text;
+}
+
+int main(int argc, char** argv){
+    if(argc < 3){
+        usage();
+        return -1;
+    }
+    std::string tracefile = argv[1];
+    std::string device = argv[2];
+    int portid = -1; //Default: the first port found in the trace
+    bool fast = false;
+    unsigned int baudrate = 9600;
+    unsigned int timeout = 100; //Time given to the board to answer, in ms
+    for(int i = 3; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg == "--fast")
+            fast = true;
+        else if(arg == "--port-id" && i + 1 < argc)
+            portid = std::stoi(argv[++i]);
+        else if(arg == "--baud" && i + 1 < argc)
+            baudrate = std::stoul(argv[++i]);
+        else if(arg == "--timeout" && i + 1 < argc)
+            timeout = std::stoul(argv[++i]);
+        else{
+            usage();
+            return -1;
+        }
+    }
+
+    //Load the runs of the selected port
+    serialTraceReader reader;
+    if(reader.open(tracefile.c_str()) != 1){
+        std::cerr << "Cannot read trace " << tracefile << std::endl;
+        return -1;
+    }
+    std::vector<Run> runs;
+    serialTraceEvent event;
+    uint64_t previous = 0;
+    while(reader.next(&event) == 1){
+        if(portid < 0)
+            portid = event.port;
+        if(event.port != portid)
+            continue;
+        bool continuation = !runs.empty() && event.sequence == previous + 1
+                            && runs.back().timestamp_ns == event.timestamp_ns
+                            && runs.back().direction == event.direction;
+        if(!continuation)
+            runs.push_back(Run{event.timestamp_ns, event.direction, {}});
+        runs.back().data.insert(runs.back().data.end(), event.data, event.data + event.length);
+        previous = event.sequence;
+    }
+    reader.close();
+    auto firsttx = std::find_if(runs.begin(), runs.end(), [](const Run& run){ return run.direction == SERIAL_TRACE_TX; });
+    if(firsttx == runs.end()){
+        std::cerr << "No transmitted bytes for port " << portid << " in " << tracefile << std::endl;
+        return -1;
+    }
+
+    serialib port;
+    if(port.openDevice(device.c_str(), baudrate) != 1){
+        std::cerr << "Connection Failed" << std::endl;
+        return -1;
+    }
+    port.flushReceiver();
+
+    //Replay
+    std::vector<double> drifts; //Lateness of each write in microseconds
+    int frames = 0, matched = 0, mismatched = 0, missing = 0, errors = 0;
+    uint64_t origin = firsttx->timestamp_ns;
+    auto start = std::chrono::steady_clock::now();
+    for(auto it = firsttx; it != runs.end(); ++it){
+        if(it->direction != SERIAL_TRACE_TX)
+            continue;
+
+        //Bytes received after this write in the capture, until the next write
+        std::vector<char> expected;
+        for(auto rx = it + 1; rx != runs.end() && rx->direction == SERIAL_TRACE_RX; ++rx)
+            expected.insert(expected.end(), rx->data.begin(), rx->data.end());
+
+        auto scheduled = start + std::chrono::nanoseconds(it->timestamp_ns - origin);
+        if(!fast)
+            std::this_thread::sleep_until(scheduled);
+        auto sent = std::chrono::steady_clock::now();
+        if(port.writeBytes(it->data.data(), it->data.size()) != 1){
+            errors++;
+            continue;
+        }
+        frames++;
+        if(!fast)
+            drifts.push_back(std::chrono::duration<double, std::micro>(sent - scheduled).count());
+
+        if(expected.empty())
+            continue;
+        std::vector<char> response(expected.size());
+        int nbread = port.readBytes(response.data(), response.size(), timeout);
+        if(nbread <= 0){
+            missing++;
+            std::cout << "frame " << frames << ": no response, expected " << toHex(expected) << std::endl;
+            continue;
+        }
+        response.resize(nbread);
+        if(response == expected){
+            matched++;
+        }
+        else{
+            mismatched++;
+            std::cout << "frame " << frames << ": response " << toHex(response)
+                      << ", expected " << toHex(expected) << std::endl;
+        }
+    }
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    double captured = (runs.back().timestamp_ns - origin) / 1e6;
+    port.closeDevice();
+
+    std::cout << "=====Replay=====" << std::endl;
+    std::cout << "Port id: " << portid << std::endl;
+    std::cout << "Frames sent: " << frames << " (" << errors << " write errors)" << std::endl;
+    std::cout << "Duration: " << elapsed << " ms (captured " << captured << " ms)" << std::endl;
+    if(!drifts.empty()){
+        std::sort(drifts.begin(), drifts.end());
+        double sum = 0;
+        for(double d : drifts)
+            sum += d;
+        std::cout << "Timing drift: mean " << sum / drifts.size() << " us, p99 "
+                  << drifts[(drifts.size() - 1) * 99 / 100] << " us, max " << drifts.back() << " us" << std::endl;
+    }
+    std::cout << "Responses: " << matched << " identical, " << mismatched << " different, "
+              << missing << " missing" << std::endl;
+    return (mismatched || missing || errors) ? 1 : 0;
+}
@@ -0,0 +1,74 @@
+#include <relaymirror.hpp>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+
+
+// Prints the relay states published in a shared memory mirror by a program driving the boards
+// (see Usbmrelay::setMirror), once or every interval. Reading the mirror takes no lock and no
+// system call, and does not slow down the switching of the owner.
+//
+// usbrelay_status <mirror name> [--watch ms]
+
+void usage(){
+    std::cerr << "usage: usbrelay_status <mirror name> [--watch ms]" << std::endl;
+}
+
+//Prints every board used in the mirror, relays numbered from 1
+void printBoards(RelayStateMirrorReader &reader){
+    for(int slot = 0; slot < reader.getBoardCount(); slot++){
+        RelayMirrorSnapshot snapshot;
+        int status = reader.read(slot, snapshot);
+        if(status == -2)
+            std::cout << slot << " busy: the owner is stalled or died while publishing" << std::endl;
+        if(status != 1)
+            continue;
+        std::string relays;
+        for(int i = 0; i < snapshot.relaynumber; i++)
+            relays += (snapshot.state >> i) & 1 ? '1' : '0';
+        double age = 0;
+        if(snapshot.timestamp_ns != 0){
+            uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+            age = now > snapshot.timestamp_ns ? (now - snapshot.timestamp_ns) / 1e6 : 0;
+        }
+        std::cout << slot << " " << snapshot.port << " " << relays << " changes=" << snapshot.sequence
+                  << " age=" << age << "ms" << std::endl;
+    }
+}
+
+int main(int argc, char** argv){
+    if(argc < 2 || argv[1][0] == '-'){
+        usage();
+        return 2;
+    }
+    unsigned long watch = 0;
+    for(int i = 2; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg == "--watch" && i + 1 < argc)
+            watch = std::stoul(argv[++i]);
+        else{
+            usage();
+            return 2;
+        }
+    }
+    RelayStateMirrorReader reader;
+    int status = reader.open(argv[1]);
+    if(status != 1){
+        std::cerr << (status == -2 ? "Not a relay mirror: " : "Cannot open ") << argv[1] << std::endl;
+        return 1;
+    }
+    printBoards(reader);
+    while(watch > 0 && reader.isOwnerAlive()){
+        std::this_thread::sleep_for(std::chrono::milliseconds(watch));
+        std::cout << std::endl;
+        printBoards(reader);
+    }
+    if(!reader.isOwnerAlive()){ //The segment outlives its owner in our mapping only
+        std::cerr << "The owner of " << argv[1] << " has exited, the states are stale" << std::endl;
+        return 1;
+    }
+    return 0;
+}